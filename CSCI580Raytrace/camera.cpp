@@ -28,16 +28,31 @@ void Camera::Focus_Camera(double focal_distance,double aspect_ratio,
     image_size=vec2(width,height);
 }
 
+// The pixel storage is not allocated here; it is allocated by Set_Window once
+// it is known how much of the image is to be kept in memory.
 void Camera::Set_Resolution(const ivec2& number_pixels_input)
 {
     number_pixels=number_pixels_input;
     if(colors) delete[] colors;
-    colors=new Pixel[number_pixels[0]*number_pixels[1]];
+    colors=0;
+    window_lo=window_hi=ivec2();
     min=-0.5*image_size;
     max=0.5*image_size;
     pixel_size = image_size/vec2(number_pixels);
 }
 
+void Camera::Set_Window(const ivec2& lo,const ivec2& hi)
+{
+    ivec2 size=hi-lo,old_size=window_hi-window_lo;
+    if(!colors || size[0]*size[1]!=old_size[0]*old_size[1])
+    {
+        delete[] colors;
+        colors=new Pixel[size[0]*size[1]];
+    }
+    window_lo=lo;
+    window_hi=hi;
+}
+
 // Find the world position of the input pixel
 vec3 Camera::World_Position(const ivec2& pixel_index)
 {
@@ -37,7 +37,8 @@ public:
 
     // Describes the pixels of the image
     ivec2 number_pixels; // number of pixels: x and y direction
-    Pixel* colors; // Pixel data; row-major order
+    ivec2 window_lo,window_hi; // pixels stored in colors: [window_lo,window_hi)
+    Pixel* colors; // Pixel data for the window; row-major order
     
     Camera();
     ~Camera();
@@ -49,6 +50,11 @@ public:
         double field_of_view);
     void Set_Resolution(const ivec2& number_pixels_input);
 
+    // Select which pixels are stored in colors.  Rendering the whole image
+    // uses a window covering every pixel; streaming renders use a band of
+    // rows at a time so that large images need not be held in memory.
+    void Set_Window(const ivec2& lo,const ivec2& hi);
+
     // Used for determining the where pixels are
     vec3 World_Position(const ivec2& pixel_index);
     vec2 Cell_Center(const ivec2& index) const
@@ -59,9 +65,9 @@ public:
     // Call to set the color of a pixel
     void Set_Pixel(const ivec2& pixel_index,const Pixel& color)
     {
-        int i=pixel_index[0];
-        int j=pixel_index[1];
-        colors[j*number_pixels[0]+i]=color;
+        int i=pixel_index[0]-window_lo[0];
+        int j=pixel_index[1]-window_lo[1];
+        colors[j*(window_hi[0]-window_lo[0])+i]=color;
     }
 };
 #endif
@@ -39,11 +39,111 @@ def run_command_with_timeout(cmd, timeout_sec):
         return False
     return True
 
+# Read a P3 ppm file, returning (width, height, values), or None.
+def read_ppm(filename):
+    try:
+        words=[]
+        for line in open(filename):
+            if not line.startswith('#'):
+                words+=line.split()
+        if words[0]!='P3':
+            return None
+        values=[int(w) for w in words[4:]]
+        width,height=int(words[1]),int(words[2])
+        if len(values)!=3*width*height:
+            return None
+        return (width,height,values)
+    except:
+        return None
+
+# The difference between two images, as ray_tracer -s reports it: the mean
+# absolute difference of the color channels, as a percentage.
+def image_diff(file, solution):
+    a=read_ppm(file)
+    b=read_ppm(solution)
+    if a==None or b==None or a[0:2]!=b[0:2]:
+        return None
+    error=sum(abs(x-y) for x,y in zip(a[2],b[2]))
+    return round(error/255.0/len(a[2])*100,2)
+
+# Grade the render server (-S) against the solution, using a scene that is
+# already in the cache, a scene file that is rewritten between jobs, and a
+# scene that has been evicted from a cache of one scene.  decoy is another
+# test, which renders to a different image.
+def run_server(options, decoy, timeout):
+    shutil.copyfile(test_dir+'/'+decoy+".txt", dir+"/decoy.txt")
+    shutil.copyfile(test_dir+'/'+decoy+".txt", dir+"/file.txt")
+    proc = subprocess.Popen(['./ray_tracer','-S','-c','1']+options,cwd=dir,
+        stdin=subprocess.PIPE,stdout=subprocess.PIPE,universal_newlines=True)
+    timer = threading.Timer(timeout, proc.kill)
+    timer.start()
+    def job(line, output):
+        try:
+            proc.stdin.write(line+"\n")
+            proc.stdin.flush()
+            return proc.stdout.readline().strip()=="done "+output
+        except (IOError, OSError):
+            return False
+    ok = job("file.txt server0.ppm","server0.ppm")
+    shutil.copyfile(test_dir+'/'+file+".txt", dir+"/file.txt")
+    ok = job("file.txt server1.ppm","server1.ppm") and ok
+    ok = job("decoy.txt server2.ppm","server2.ppm") and ok
+    ok = job("file.txt server3.ppm size 64 48","server3.ppm") and ok
+    ok = job("file.txt server4.ppm","server4.ppm") and ok
+    try:
+        proc.stdin.close()
+    except (IOError, OSError):
+        pass
+    proc.wait()
+    timer.cancel()
+    if proc.returncode==-9:
+        return "TIMEOUT"
+    if not ok or proc.returncode!=0:
+        return None
+    d1=image_diff(dir+"/server1.ppm",dir+"/file.ppm")
+    d4=image_diff(dir+"/server4.ppm",dir+"/file.ppm")
+    if d1==None or d4==None:
+        return None
+    return max(d1,d4)
+
+# Grade a render that writes output.ppm without comparing it to a solution
+# itself, such as streaming (-b).
+def run_output(options, timeout):
+    if not run_command_with_timeout(['./ray_tracer','-i','file.txt']+options, timeout):
+        return "TIMEOUT"
+    return image_diff(dir+"/output.ppm",dir+"/file.ppm")
+
+# Grade a frame split into a grid of columns x rows tiles (-t), each rendered
+# by its own process, and assembled by merge_tiles.
+def run_tiles(options, grid, timeout):
+    size=read_ppm(dir+"/file.ppm")
+    columns,rows=[int(n) for n in grid.split('x')]
+    tiles=[]
+    for j in range(rows):
+        for i in range(columns):
+            window="%d,%d,%d,%d"%(size[0]*i//columns,size[1]*j//rows,
+                size[0]*(i+1)//columns,size[1]*(j+1)//rows)
+            if os.path.isfile(dir+"/output.ppm"):
+                os.remove(dir+"/output.ppm")
+            if not run_command_with_timeout(['./ray_tracer','-i','file.txt','-t',window]+options, timeout):
+                return "TIMEOUT"
+            if not os.path.isfile(dir+"/output.ppm"):
+                return None
+            tiles.append("tile%d.ppm"%len(tiles))
+            os.rename(dir+"/output.ppm",dir+"/"+tiles[-1])
+    if subprocess.call(['./merge_tiles','merged.ppm']+tiles,cwd=dir)!=0:
+        return None
+    return image_diff(dir+"/merged.ppm",dir+"/file.ppm")
+
 hashed_tests={}
 total_score=0
 
+# A test may name a solution other than its own image, followed by options
+# for the ray tracer.  -S <decoy> grades the render server instead, and with
+# -b the streamed output.ppm is graded.  -t <columns>x<rows> grades a frame
+# rendered as a grid of tiles and assembled by merge_tiles.
 ignore_line=re.compile('^\s*(#|$)')
-grade_line=re.compile('^(\S+)\s+(\S+)\s+(\S+)\s*$')
+grade_line=re.compile('^(\S+)\s+(\S+)\s+(\S+)((?:\s+\S+)*)\s*$')
 gs=0
 try:
     gs=open('grading-scheme.txt')
@@ -64,15 +164,28 @@ for line in gs.readlines():
     points=float(g.groups()[0])
     max_error=float(g.groups()[1])
     file=g.groups()[2]
+    options=g.groups()[3].split()
+    solution=file
+    if options and options[0][0]!='-':
+        solution=options.pop(0)
+    name=' '.join([file]+([solution] if solution!=file else [])+options)
 
     pass_error = 0
     pass_time = 0
-    if file not  in hashed_tests:
+    if name not in hashed_tests:
         timeout = 10
         shutil.copyfile(test_dir+'/'+file+".txt", dir+"/file.txt")
-        shutil.copyfile(test_dir+'/'+file+".ppm", dir+"/file.ppm")
-        if not run_command_with_timeout(grade_cmd, timeout):
-            hashed_tests[file]="TIMEOUT"
+        shutil.copyfile(test_dir+'/'+solution+".ppm", dir+"/file.ppm")
+        if '-S' in options:
+            i=options.index('-S')
+            hashed_tests[name]=run_server(options[:i]+options[i+2:],options[i+1],timeout)
+        elif '-t' in options:
+            i=options.index('-t')
+            hashed_tests[name]=run_tiles(options[:i]+options[i+2:],options[i+1],timeout)
+        elif '-b' in options:
+            hashed_tests[name]=run_output(options,timeout)
+        elif not run_command_with_timeout(grade_cmd+options, timeout):
+            hashed_tests[name]="TIMEOUT"
         else:
             try:
                 report = dir+'/'+token+'.txt'
@@ -82,23 +195,23 @@ for line in gs.readlines():
                 if os.path.isfile(report):
                     os.remove(report) # remove the diff file
                 if d: d=float(d.groups()[0])
-                hashed_tests[file]=d
+                hashed_tests[name]=d
             except:
-                hashed_tests[file]=None
+                hashed_tests[name]=None
 
-    d=hashed_tests[file]
+    d=hashed_tests[name]
     if d=="TIMEOUT":
-        print("FAIL: (%s) Test timed out."%file)
+        print("FAIL: (%s) Test timed out."%name)
         points=0
     elif d==None:
-        print("FAIL: (%s) Program failed to report statistics."%file)
+        print("FAIL: (%s) Program failed to report statistics."%name)
         points=0
     else:
         if d>max_error:
-            print("FAIL: (%s) Too much error. Actual: %g  Max: %g."%(file,d,max_error))
+            print("FAIL: (%s) Too much error. Actual: %g  Max: %g."%(name,d,max_error))
             points=0
         else:
-            print("PASS: (%s) diff %g vs %g."%(file,d,max_error))
+            print("PASS: (%s) diff %g vs %g."%(name,d,max_error))
 
     if points>0:
         print("+%g points"%points)
@@ -1,5 +1,6 @@
 #include "render_world.h"
 #include "object.h"
+#include "scene_cache.h"
 #include <iostream>
 #include <fstream>
 #include <sstream>
@@ -101,14 +102,27 @@ bool Read_ppm(Pixel *& data, int& width, int& height, const char* filename) {
     return true;
 }
 
-void Dump_ppm(Pixel* data,int width,int height,const char* filename)
+void Write_ppm_Pixel(std::ostream& file,Pixel pixel)
+{
+    unsigned char red   = (pixel >> 24) & 0xFF;
+    unsigned char green = (pixel >> 16) & 0xFF;
+    unsigned char blue  = (pixel >> 8) & 0xFF;
+
+    file << static_cast<int>(red)   << " "
+        << static_cast<int>(green) << " "
+        << static_cast<int>(blue)  << "\n";
+}
+
+// Save the image to filename, noting this on log.  Returns false if the file
+// cannot be written.
+bool Dump_ppm(Pixel* data,int width,int height,const char* filename,std::ostream& log=std::cout)
 {
     std::ofstream file(filename, std::ios::binary);
-    std::cout << "Dumping output to " << filename << std::endl;
+    log << "Dumping output to " << filename << std::endl;
     
     if (!file) {
         std::cerr << "Error: Could not open file for writing." << std::endl;
-        return;
+        return false;
     }
 
     // Write PPM header
@@ -119,23 +133,117 @@ void Dump_ppm(Pixel* data,int width,int height,const char* filename)
     // Write pixel data
     for (int y = 0; y < height; ++y) {
         for (int x = 0; x < width; ++x) {
-            unsigned int pixel = data[(height - y - 1) * width + x];
-            unsigned char red   = (pixel >> 24) & 0xFF;
-            unsigned char green = (pixel >> 16) & 0xFF;
-            unsigned char blue  = (pixel >> 8) & 0xFF;
-
-            file << static_cast<int>(red)   << " "
-                << static_cast<int>(green) << " "
-                << static_cast<int>(blue)  << "\n";
+            Write_ppm_Pixel(file, data[(height - y - 1) * width + x]);
+        }
+    }
+
+    file.close();
+    if (!file) {
+        std::cerr << "Error: Failed to write " << filename << "." << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Render the image in bands of band_rows rows, appending each band to the
+// output file as soon as it is finished.  Only one band is held in memory at
+// a time.  The ppm format stores the top row first, so the bands are rendered
+// from the top of the image down.  Returns false if the file cannot be
+// opened or a band fails to be written, which leaves a truncated image.
+bool Render_Streaming(Render_World& world,int band_rows,const char* filename)
+{
+    std::ofstream file(filename, std::ios::binary);
+    std::cout << "Streaming output to " << filename << std::endl;
+
+    if (!file) {
+        std::cerr << "Error: Could not open file for writing." << std::endl;
+        return false;
+    }
+
+    Camera& camera = world.camera;
+    int width = camera.number_pixels[0];
+    int height = camera.number_pixels[1];
+    file << "P3\n" << width << " " << height << "\n" << "255\n";
+
+    for (int hi = height; hi > 0; hi -= band_rows) {
+        int lo = std::max(hi - band_rows, 0);
+        camera.Set_Window(ivec2(0, lo), ivec2(width, hi));
+        world.Render_Window();
+        for (int y = hi - 1; y >= lo; --y) {
+            for (int x = 0; x < width; ++x) {
+                Write_ppm_Pixel(file, camera.colors[(y - lo) * width + x]);
+            }
         }
+        file.flush();
+        if (!file) break;
     }
 
     file.close();
+    if (!file) {
+        std::cerr << "Error: Failed to write " << filename << "." << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Render only the pixels in [lo,hi) and save them as a partial image.  The
+// partial image is an ordinary ppm file whose header carries a comment line
+//
+// # tile <x0> <y0> <x1> <y1> <image-width> <image-height>
+//
+// recording where it belongs in the full image.  Partial images are assembled
+// into the full image by merge_tiles.  Returns false if the window is empty or
+// extends outside the image, or the file cannot be written.
+bool Render_Tile(Render_World& world,ivec2 lo,ivec2 hi,const char* filename)
+{
+    Camera& camera = world.camera;
+    for (int i = 0; i < 2; ++i) {
+        if (lo[i] < 0 || hi[i] <= lo[i] || hi[i] > camera.number_pixels[i]) {
+            std::cerr << "Error: Tile " << lo[0] << "," << lo[1] << "," << hi[0] << "," << hi[1]
+                      << " is empty or lies outside the " << camera.number_pixels[0] << "x"
+                      << camera.number_pixels[1] << " image." << std::endl;
+            return false;
+        }
+    }
+    camera.Set_Window(lo, hi);
+    world.Render_Window();
+
+    std::ofstream file(filename, std::ios::binary);
+    std::cout << "Dumping tile to " << filename << std::endl;
+
+    if (!file) {
+        std::cerr << "Error: Could not open file for writing." << std::endl;
+        return false;
+    }
+
+    int width = hi[0] - lo[0];
+    int height = hi[1] - lo[1];
+    file << "P3\n";
+    file << "# tile " << lo[0] << " " << lo[1] << " " << hi[0] << " " << hi[1] << " "
+         << camera.number_pixels[0] << " " << camera.number_pixels[1] << "\n";
+    file << width << " " << height << "\n";
+    file << "255\n";
+
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            Write_ppm_Pixel(file, camera.colors[(height - y - 1) * width + x]);
+        }
+    }
+
+    file.close();
+    if (!file) {
+        std::cerr << "Error: Failed to write " << filename << "." << std::endl;
+        return false;
+    }
+    return true;
 }
 
 /*
 
-  Usage: ./ray_tracer -i <test-file> [ -s <solution-file> ] [ -o <stats-file> ] [ -x <debug-x-coord> -y <debug-y-coord> ]
+  Usage: ./ray_tracer -i <test-file> [ -s <solution-file> ] [ -o <stats-file> ] [ -x <debug-x-coord> -y <debug-y-coord> ] [ -w <min-ray-weight> ] [ -r ]
+         ./ray_tracer -i <test-file> -b <band-rows>
+         ./ray_tracer -i <test-file> -t <x0>,<y0>,<x1>,<y1>
+         ./ray_tracer -S [ -c <cache-size> ] [ -w <min-ray-weight> ]
 
   Examples:
 
@@ -162,6 +270,59 @@ void Dump_ppm(Pixel* data,int width,int height,const char* filename)
   tracer to be printed to a file rather than to the standard output.  This
   prevents the grading script from getting confused by debugging output.
 
+  ./ray_tracer -i 25.txt -w 0.004
+
+  Stops tracing reflected rays once their accumulated weight (the product of
+  the reflectivities along the path) drops below 0.004, overriding the scene's
+  min_ray_weight.  If the scene enables russian_roulette, rays below the
+  threshold are instead continued at random with their color scaled up to
+  compensate.  Russian roulette is always disabled when comparing against a
+  solution with -s, so that grading stays deterministic.
+
+  ./ray_tracer -i 27.txt -r
+
+  Finds what is visible through each pixel by rasterizing the mesh triangles
+  into a visibility buffer instead of tracing primary rays through the
+  hierarchy.  Shadow and reflected rays are still traced, as are primary rays
+  against spheres, planes and triangles that cross the plane of the camera.
+  This can be combined with any of the other options, including -S.
+
+  ./ray_tracer -i 00.txt -b 64
+
+  Renders the scene 64 rows at a time, writing each band of rows to
+  output.ppm as soon as it is finished.  Only one band is kept in memory, which
+  makes very large images practical.  Cannot be combined with -s, -x or -y,
+  which need the whole image.
+
+  ./ray_tracer -i 00.txt -t 0,0,320,240
+
+  Renders only the pixels with 0<=x<320 and 0<=y<240 (y=0 is the bottom row)
+  and saves them to output.ppm as a partial image, whose header records where
+  the tile belongs.  A frame can be split into tiles that are rendered by
+  independent processes, possibly on different machines, and then assembled:
+
+  ./merge_tiles output.ppm tile0.ppm tile1.ppm ...
+
+  The window must be non-empty and lie within the image.  Like -b, this
+  cannot be combined with -s, -x or -y.
+
+  ./ray_tracer -S -c 16
+
+  Runs as a render server.  Jobs are read from standard input, one per line:
+
+  <test-file> <output-file> [ size <w> <h> ] [ camera <position> <look-at> <up> <fov> ]
+
+  The optional size and camera overrides take the same arguments as in the
+  scene file.  Parsed scenes (including their meshes and hierarchy) are kept
+  in a cache of the -c most recently used scenes (default 8), keyed by the
+  modification times and sizes of the scene file and its meshes, so repeated
+  jobs skip parsing and hierarchy construction.  A line "done <output-file>"
+  or "error <message>" is written to standard output for each job, and
+  nothing else; a job whose scene cannot be read or parsed fails on its own,
+  without stopping the server.  Each job starts from the scene as the file
+  set it up, with -w applied and its own freshly seeded random numbers, so
+  its image does not depend on the jobs before it.
+
  */
 
 // Indicates that we are debugging one pixel; can be accessed everywhere.
@@ -174,25 +335,100 @@ bool disable_hierarchy=false;
 
 void Usage(const char* exec)
 {
-    std::cerr<<"Usage: "<<exec<<" -i <test-file> [ -s <solution-file> ] [ -o <stats-file> ] [ -x <debug-x-coord> -y <debug-y-coord> ]"<<std::endl;
+    std::cerr<<"Usage: "<<exec<<" -i <test-file> [ -s <solution-file> ] [ -o <stats-file> ] [ -x <debug-x-coord> -y <debug-y-coord> ] [ -w <min-ray-weight> ] [ -r ]"<<std::endl;
+    std::cerr<<"       "<<exec<<" -i <test-file> -b <band-rows>"<<std::endl;
+    std::cerr<<"       "<<exec<<" -i <test-file> -t <x0>,<y0>,<x1>,<y1>"<<std::endl;
+    std::cerr<<"       "<<exec<<" -S [ -c <cache-size> ] [ -w <min-ray-weight> ]"<<std::endl;
     exit(1);
 }
 
-void Parse(Render_World& world,int& width,int& height,const char* test_file);
+bool Parse(Render_World& world,int& width,int& height,const char* test_file,std::string& error);
 void Dump_png(Pixel* data,int width,int height,const char* filename);
 void Read_png(Pixel*& data,int& width,int& height,const char* filename);
 
+// Render jobs read from standard input until it is closed.  See the usage
+// notes above for the job format.
+void Run_Server(size_t cache_size,bool raster_primary,double min_ray_weight)
+{
+    Scene_Cache cache(cache_size);
+    std::string line;
+    while(getline(std::cin,line))
+    {
+        std::stringstream ss(line);
+        std::string scene_file,output_file,item;
+        if(!(ss>>scene_file) || scene_file[0]=='#') continue;
+        if(!(ss>>output_file))
+        {
+            std::cout<<"error missing output file"<<std::endl;
+            continue;
+        }
+
+        std::string error;
+        Cached_Scene* scene=cache.Lookup(scene_file,error);
+        if(!scene)
+        {
+            std::cout<<"error "<<error<<std::endl;
+            continue;
+        }
+        scene->Reset();
+        scene->world.raster_primary=raster_primary;
+        if(min_ray_weight>=0) scene->world.min_ray_weight=min_ray_weight;
+        Camera& camera=scene->world.camera;
+        ivec2 size(scene->width,scene->height);
+
+        bool valid=true;
+        while(valid && ss>>item)
+        {
+            if(item=="size")
+            {
+                valid=(ss>>size[0]>>size[1]) && size[0]>0 && size[1]>0;
+                if(!valid) break;
+                camera.image_size[1]=camera.image_size[0]*size[1]/size[0];
+                camera.Set_Resolution(size);
+            }
+            else if(item=="camera")
+            {
+                vec3 u,v,w;
+                double f0;
+                valid=(bool)(ss>>u>>v>>w>>f0);
+                if(!valid) break;
+                camera.Position_And_Aim_Camera(u,v,w);
+                camera.Focus_Camera(1,(double)size[0]/size[1],f0*(pi/180));
+                camera.Set_Resolution(size);
+            }
+            else valid=false;
+        }
+        if(!valid)
+        {
+            std::cout<<"error failed to parse job: "<<line<<std::endl;
+            continue;
+        }
+
+        scene->world.Render();
+        // Standard output only carries the responses to jobs.
+        if(Dump_ppm(camera.colors,size[0],size[1],output_file.c_str(),std::cerr))
+            std::cout<<"done "<<output_file<<std::endl;
+        else std::cout<<"error "<<output_file<<" could not be written"<<std::endl;
+    }
+}
+
 int main(int argc, char** argv)
 {
     const char* solution_file = 0;
     const char* input_file = 0;
     const char* statistics_file = 0;
     int test_x=-1, test_y=-1;
+    bool server=false;
+    int cache_size=8;
+    int band_rows=0;
+    const char* tile=0;
+    double min_ray_weight=-1;
+    bool raster_primary=false;
 
     // Parse commandline options
     while(1)
     {
-        int opt = getopt(argc, argv, "s:i:m:o:x:y:h");
+        int opt = getopt(argc, argv, "s:i:m:o:x:y:hSc:b:t:w:r");
         if(opt==-1) break;
         switch(opt)
         {
@@ -202,16 +438,50 @@ int main(int argc, char** argv)
             case 'x': test_x = atoi(optarg); break;
             case 'y': test_y = atoi(optarg); break;
             case 'h': disable_hierarchy=true; break;
+            case 'S': server=true; break;
+            case 'c': cache_size = atoi(optarg); break;
+            case 'b': band_rows = atoi(optarg); break;
+            case 't': tile = optarg; break;
+            case 'w': min_ray_weight = atof(optarg); break;
+            case 'r': raster_primary=true; break;
         }
     }
+    if(server)
+    {
+        Run_Server(std::max(cache_size,1),raster_primary,min_ray_weight);
+        return 0;
+    }
     if(!input_file) Usage(argv[0]);
+    if((band_rows>0 || tile) && (solution_file || test_x>=0 || test_y>=0)) Usage(argv[0]);
+    ivec2 tile_lo,tile_hi;
+    if(tile && sscanf(tile,"%d,%d,%d,%d",&tile_lo[0],&tile_lo[1],&tile_hi[0],&tile_hi[1])!=4)
+        Usage(argv[0]);
 
     int width=0;
     int height=0;
     Render_World world;
     
     // Parse test scene file
-    Parse(world,width,height,input_file);
+    std::string error;
+    if(!Parse(world,width,height,input_file,error))
+    {
+        std::cout<<error<<std::endl;
+        exit(EXIT_FAILURE);
+    }
+    if(min_ray_weight>=0) world.min_ray_weight=min_ray_weight;
+    if(solution_file) world.russian_roulette=false;
+    world.raster_primary=raster_primary;
+
+    if(tile)
+    {
+        if(!Render_Tile(world,tile_lo,tile_hi,"output.ppm")) exit(EXIT_FAILURE);
+        return 0;
+    }
+    if(band_rows>0)
+    {
+        if(!Render_Streaming(world,band_rows,"output.ppm")) exit(EXIT_FAILURE);
+        return 0;
+    }
 
     // Render the image
     world.Render();
@@ -232,7 +502,7 @@ int main(int argc, char** argv)
     }
 
     // Save the rendered image to disk
-    Dump_ppm(world.camera.colors,width,height,"output.ppm");
+    if(!Dump_ppm(world.camera.colors,width,height,"output.ppm")) exit(EXIT_FAILURE);
 
     // If a solution is specified, compare against it.
     if(solution_file)
@@ -0,0 +1,149 @@
+/*
+
+  Usage: ./merge_tiles <output-file> <tile-file> [ <tile-file> ... ]
+
+  Assembles the partial images written by "ray_tracer -t x0,y0,x1,y1" into a
+  single ppm image.  Each partial image records in its header which pixels it
+  covers and the size of the full image, so the tiles may be listed in any
+  order.  The tiles must cover every pixel of the image exactly once.  If a
+  pixel is covered by no tile, or by more than one, the image is still written
+  (with uncovered pixels black and the last tile winning) but an error is
+  printed and the exit status is nonzero.
+
+ */
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+struct Tile
+{
+    int x0,y0,x1,y1; // pixels covered: [x0,x1) x [y0,y1); y=0 is the bottom row
+    int image_width,image_height;
+    std::vector<int> rgb; // three values per pixel, top row first
+};
+
+// Read a partial image written by Render_Tile.
+bool Read_Tile(Tile& tile,const char* filename)
+{
+    std::ifstream file(filename);
+
+    if (!file) {
+        std::cerr << "Error: Could not open " << filename << " for reading." << std::endl;
+        return false;
+    }
+
+    std::string line,item;
+    std::getline(file, line);
+    if (line != "P3") {
+        std::cerr << "Error: Unsupported PPM format in " << filename << "." << std::endl;
+        return false;
+    }
+
+    std::getline(file, line);
+    std::istringstream header(line);
+    if (!(header >> item >> item) || item != "tile" ||
+        !(header >> tile.x0 >> tile.y0 >> tile.x1 >> tile.y1 >> tile.image_width >> tile.image_height)) {
+        std::cerr << "Error: " << filename << " is not a partial image." << std::endl;
+        return false;
+    }
+
+    // Check the window before using it to size anything.
+    if (tile.x0 < 0 || tile.y0 < 0 || tile.x1 <= tile.x0 || tile.y1 <= tile.y0 ||
+        tile.x1 > tile.image_width || tile.y1 > tile.image_height) {
+        std::cerr << "Error: " << filename << " is empty or lies outside the image." << std::endl;
+        return false;
+    }
+
+    int width, height, maxVal;
+    file >> width >> height >> maxVal;
+    if (width != tile.x1 - tile.x0 || height != tile.y1 - tile.y0 || maxVal != 255) {
+        std::cerr << "Error: Inconsistent header in " << filename << "." << std::endl;
+        return false;
+    }
+
+    tile.rgb.resize(3 * width * height);
+    for (size_t i = 0; i < tile.rgb.size(); ++i) {
+        if (!(file >> tile.rgb[i])) {
+            std::cerr << "Error: " << filename << " is truncated." << std::endl;
+            return false;
+        }
+    }
+
+    file.close();
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    if(argc<3)
+    {
+        std::cerr<<"Usage: "<<argv[0]<<" <output-file> <tile-file> [ <tile-file> ... ]"<<std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    int width=0,height=0;
+    std::vector<int> rgb;
+    std::vector<bool> covered;
+    int overlapping=0;
+
+    for(int t=2;t<argc;t++)
+    {
+        Tile tile;
+        if(!Read_Tile(tile,argv[t])) exit(EXIT_FAILURE);
+
+        if(t==2)
+        {
+            width=tile.image_width;
+            height=tile.image_height;
+            rgb.assign(3*width*height,0);
+            covered.assign(width*height,false);
+        }
+        else if(tile.image_width!=width || tile.image_height!=height)
+        {
+            std::cerr<<"Error: "<<argv[t]<<" belongs to a "<<tile.image_width<<"x"<<tile.image_height
+                     <<" image, not "<<width<<"x"<<height<<"."<<std::endl;
+            exit(EXIT_FAILURE);
+        }
+
+        // Both files store the top row first.
+        int tile_width=tile.x1-tile.x0;
+        int tile_height=tile.y1-tile.y0;
+        for(int y=0;y<tile_height;y++)
+            for(int x=0;x<tile_width;x++)
+            {
+                int i=(height-tile.y1+y)*width+tile.x0+x;
+                for(int c=0;c<3;c++)
+                    rgb[3*i+c]=tile.rgb[3*(y*tile_width+x)+c];
+                if(covered[i]) overlapping++;
+                covered[i]=true;
+            }
+    }
+
+    int missing=0;
+    for(size_t i=0;i<covered.size();i++)
+        if(!covered[i]) missing++;
+    if(missing)
+        std::cerr<<"Error: "<<missing<<" pixels are not covered by any tile."<<std::endl;
+    if(overlapping)
+        std::cerr<<"Error: "<<overlapping<<" pixels are covered by more than one tile."<<std::endl;
+
+    std::ofstream file(argv[1], std::ios::binary);
+    std::cout << "Dumping output to " << argv[1] << std::endl;
+
+    if (!file) {
+        std::cerr << "Error: Could not open file for writing." << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    file << "P3\n";
+    file << width << " " << height << "\n";
+    file << "255\n";
+    for(int i=0;i<width*height;i++)
+        file << rgb[3*i] << " " << rgb[3*i+1] << " " << rgb[3*i+2] << "\n";
+
+    file.close();
+    return missing || overlapping ? EXIT_FAILURE : 0;
+}
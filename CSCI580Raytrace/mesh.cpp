@@ -8,13 +8,15 @@
 static const double weight_tolerance = 1e-4;
 
 // Read in a mesh from an obj file.  Populates the bounding box and registers
-// one part per triangle (by setting number_parts). Given.
-void Mesh::Read_Obj(const char* file)
+// one part per triangle (by setting number_parts). Given.  Returns false, with
+// a message in error, if the file cannot be read.
+bool Mesh::Read_Obj(const char* file,std::string& error)
 {
     std::ifstream fin(file);
     if(!fin)
     {
-        exit(EXIT_FAILURE);
+        error=std::string("Failed to open mesh file '")+file+"'";
+        return false;
     }
     std::string line;
     ivec3 e;
@@ -36,6 +38,7 @@ void Mesh::Read_Obj(const char* file)
         }
     }
     number_parts=triangles.size();
+    return true;
 }
 
 // Check for an intersection against the ray.  See the base class for details.
@@ -154,6 +157,14 @@ bool Mesh::Intersect_Triangle(const Ray& ray, int tri, double& dist) const
     return false;
 }
 
+// Return the three corners of the triangle with index tri.
+void Mesh::Triangle_Vertices(int tri, vec3& a, vec3& b, vec3& c) const
+{
+    a = vertices[triangles[tri][0]];
+    b = vertices[triangles[tri][1]];
+    c = vertices[triangles[tri][2]];
+}
+
 // Compute the bounding box.  Return the bounding box of only the triangle whose
 // index is part.
 Box Mesh::Bounding_Box(int part) const
@@ -1,6 +1,7 @@
 #ifndef __MESH_H__
 #define __MESH_H__
 
+#include <string>
 #include "object.h"
 
 // Consider a hit to be inside a triange if all barycentric weights
@@ -20,7 +21,8 @@ public:
     virtual Hit Intersection(const Ray& ray, int part) const override;
     virtual vec3 Normal(const vec3& point, int part) const override;
     bool Intersect_Triangle(const Ray& ray, int tri, double& dist) const;
-    void Read_Obj(const char* file);
+    void Triangle_Vertices(int tri, vec3& a, vec3& b, vec3& c) const;
+    bool Read_Obj(const char* file,std::string& error);
     Box Bounding_Box(int part) const override;
 };
 #endif
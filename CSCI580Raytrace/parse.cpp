@@ -16,13 +16,15 @@
 
 //This ray-tracer uses a custom scene file format that is human readable
 //It is lacking heirachial information and its much less descriptively powerfull than .usd or .gltf
-void Parse(Render_World& world,int& width,int& height,const char* test_file)
+//Returns false, with a message in error, if the file cannot be read or a line
+//of it is malformed; world then holds whatever was parsed before that line.
+bool Parse(Render_World& world,int& width,int& height,const char* test_file,std::string& error)
 {
     FILE* F = fopen(test_file,"r");
     if(!F)
     {
-        std::cout<<"Failed to open file '"<<test_file<<"'\n";
-        exit(EXIT_FAILURE);
+        error=std::string("Failed to open file '")+test_file+"'";
+        return false;
     }
 
     double f0;
@@ -34,12 +36,34 @@ void Parse(Render_World& world,int& width,int& height,const char* test_file)
     std::map<std::string,Shader*> shaders;
     shaders["-"]=0;
 
+    // Stop parsing, reporting what is wrong with the current line.
+    auto fail=[&](const std::string& what)
+    {
+        std::string line(buff);
+        while(line.size() && (line.back()=='\n' || line.back()=='\r')) line.pop_back();
+        error=what+": "+line;
+        fclose(F);
+        return false;
+    };
+
+    // The world owns every shader, whether or not anything uses it.
+    auto add_shader=[&](Shader* sh)
+    {
+        world.shaders.push_back(sh);
+        return sh;
+    };
+
     auto finish_parse_object=[&](Object* o)
     {
         std::map<std::string,Shader*>::const_iterator sh=shaders.find(mat);
-        assert(sh!=shaders.end());
+        if(sh==shaders.end())
+        {
+            delete o;
+            return false;
+        }
         o->material_shader=sh->second;
         world.objects.push_back(o);
+        return true;
     };
 
     while(fgets(buff, sizeof(buff), F))
@@ -50,111 +74,123 @@ void Parse(Render_World& world,int& width,int& height,const char* test_file)
         if(item=="size")
         {
             ss>>width>>height;
-            assert(ss);
+            if(!ss) return fail("Failed to parse");
         }
         else if(item=="color")
         {
             ss>>name>>u;
-            assert(ss);
+            if(!ss) return fail("Failed to parse");
             colors[name]=u;
         }
         else if(item=="plane")
         {
             ss>>u>>v>>mat;
-            assert(ss);
-            finish_parse_object(new Plane(u,v));
+            if(!ss) return fail("Failed to parse");
+            if(!finish_parse_object(new Plane(u,v))) return fail("Unknown shader");
         }
         else if(item=="sphere")
         {
             ss>>u>>f0>>mat;
-            assert(ss);
-            finish_parse_object(new Sphere(u,f0));
+            if(!ss) return fail("Failed to parse");
+            if(!finish_parse_object(new Sphere(u,f0))) return fail("Unknown shader");
         }
         else if(item=="mesh")
         {
             ss>>s0>>mat;
-            assert(ss);
+            if(!ss) return fail("Failed to parse");
             Mesh* o=new Mesh;
-            o->Read_Obj(s0.c_str());
-            finish_parse_object(o);
+            if(!o->Read_Obj(s0.c_str(),error))
+            {
+                delete o;
+                return fail(error);
+            }
+            if(!finish_parse_object(o)) return fail("Unknown shader");
         }
         else if(item=="flat_shader")
         {
             ss>>name>>s0;
-            assert(ss);
+            if(!ss) return fail("Failed to parse");
             std::map<std::string,vec3>::const_iterator c0=colors.find(s0);
-            assert(c0!=colors.end());
-            shaders[name]=new Flat_Shader(world,c0->second);
+            if(c0==colors.end()) return fail("Unknown color");
+            shaders[name]=add_shader(new Flat_Shader(world,c0->second));
         }
         else if(item=="phong_shader")
         {
             ss>>name>>s0>>s1>>s2>>f0;
-            assert(ss);
+            if(!ss) return fail("Failed to parse");
             std::map<std::string,vec3>::const_iterator c0=colors.find(s0);
             std::map<std::string,vec3>::const_iterator c1=colors.find(s1);
             std::map<std::string,vec3>::const_iterator c2=colors.find(s2);
-            assert(c0!=colors.end());
-            assert(c1!=colors.end());
-            assert(c2!=colors.end());
-            shaders[name]=new Phong_Shader(world,c0->second,c1->second,c2->second,f0);
+            if(c0==colors.end()) return fail("Unknown color");
+            if(c1==colors.end()) return fail("Unknown color");
+            if(c2==colors.end()) return fail("Unknown color");
+            shaders[name]=add_shader(new Phong_Shader(world,c0->second,c1->second,c2->second,f0));
         }
         else if(item=="reflective_shader")
         {
             ss>>name>>s0>>f0;
-            assert(ss);
+            if(!ss) return fail("Failed to parse");
             std::map<std::string,Shader*>::const_iterator sh=shaders.find(s0);
-            assert(sh!=shaders.end());
-            shaders[name]=new Reflective_Shader(world,sh->second,f0);
+            if(sh==shaders.end()) return fail("Unknown shader");
+            shaders[name]=add_shader(new Reflective_Shader(world,sh->second,f0));
         }
         else if(item=="point_light")
         {
             ss>>u>>s0>>f0;
-            assert(ss);
+            if(!ss) return fail("Failed to parse");
             std::map<std::string,vec3>::const_iterator c0=colors.find(s0);
-            assert(c0!=colors.end());
+            if(c0==colors.end()) return fail("Unknown color");
             world.lights.push_back(new Point_Light(u,c0->second,f0));
         }
         else if(item=="ambient_light")
         {
             ss>>s0>>f0;
-            assert(ss);
+            if(!ss) return fail("Failed to parse");
             std::map<std::string,vec3>::const_iterator c0=colors.find(s0);
-            assert(c0!=colors.end());
+            if(c0==colors.end()) return fail("Unknown color");
             world.ambient_color=c0->second;
             world.ambient_intensity=f0;
         }
         else if(item=="camera")
         {
             ss>>u>>v>>w>>f0;
-            assert(ss);
+            if(!ss) return fail("Failed to parse");
             world.camera.Position_And_Aim_Camera(u,v,w);
             world.camera.Focus_Camera(1,(double)width/height,f0*(pi/180));
         }
         else if(item=="background")
         {
             ss>>s0;
-            assert(ss);
+            if(!ss) return fail("Failed to parse");
             std::map<std::string,Shader*>::const_iterator sh=shaders.find(s0);
-            assert(sh!=shaders.end());
+            if(sh==shaders.end()) return fail("Unknown shader");
             world.background_shader=sh->second;
         }
         else if(item=="enable_shadows")
         {
             ss>>world.enable_shadows;
-            assert(ss);
+            if(!ss) return fail("Failed to parse");
         }
         else if(item=="recursion_depth_limit")
         {
             ss>>world.recursion_depth_limit;
-            assert(ss);
+            if(!ss) return fail("Failed to parse");
+        }
+        else if(item=="min_ray_weight")
+        {
+            ss>>world.min_ray_weight;
+            if(!ss) return fail("Failed to parse");
         }
-        else
+        else if(item=="russian_roulette")
         {
-            std::cout<<"Failed to parse: "<<buff<<std::endl;
-            exit(EXIT_FAILURE);
+            ss>>world.russian_roulette;
+            if(!ss) return fail("Failed to parse");
         }
+        else return fail("Failed to parse");
     }
+    fclose(F);
     if(!world.background_shader)
-        world.background_shader=new Flat_Shader(world,vec3());
+        world.background_shader=add_shader(new Flat_Shader(world,vec3()));
     world.camera.Set_Resolution(ivec2(width,height));
+    return true;
 }
@@ -9,13 +9,15 @@ class Ray
 public:
     vec3 endpoint; // endpoint of the ray where t=0
     vec3 direction; // direction the ray sweeps out - unit vector
+    double weight; // fraction of the pixel color that this ray contributes
 
     Ray()
-        :endpoint(0,0,0),direction(0,0,1)
+        :endpoint(0,0,0),direction(0,0,1),weight(1)
     {}
 
-    Ray(const vec3& endpoint_input,const vec3& direction_input)
-        :endpoint(endpoint_input),direction(direction_input.normalized())
+    Ray(const vec3& endpoint_input,const vec3& direction_input,double weight_input=1)
+        :endpoint(endpoint_input),direction(direction_input.normalized()),
+        weight(weight_input)
     {}
 
     vec3 Point(double t) const
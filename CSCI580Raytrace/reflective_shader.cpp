@@ -18,7 +18,7 @@ Shade_Surface(const Ray& ray,const vec3& intersection_point,
         std::cout << "[Reflective_Shader] Intersection point: " << intersection_point << std::endl;
         std::cout << "[Reflective_Shader] Reflection direction: " << reflection_dir << std::endl;
     }
-    Ray reflection_ray(intersection_point + reflection_dir * small_t, reflection_dir);
+    Ray reflection_ray(intersection_point + reflection_dir * small_t, reflection_dir, ray.weight * reflectivity);
     vec3 reflection_color = world.Cast_Ray(reflection_ray, recursion_depth-1);
     color += reflectivity * reflection_color;
     // color = reflectivity * reflection_color;
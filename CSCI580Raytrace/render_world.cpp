@@ -11,12 +11,13 @@ extern bool disable_hierarchy;
 
 Render_World::Render_World()
     :background_shader(0),ambient_intensity(0),enable_shadows(true),
-    recursion_depth_limit(3)
+    recursion_depth_limit(3),min_ray_weight(0),russian_roulette(false),
+    raster_primary(false)
 {}
 
 Render_World::~Render_World()
 {
-    delete background_shader;
+    for(size_t i=0;i<shaders.size();i++) delete shaders[i];
     for(size_t i=0;i<objects.size();i++) delete objects[i];
     for(size_t i=0;i<lights.size();i++) delete lights[i];
 }
@@ -59,6 +60,50 @@ Hit Render_World::Closest_Intersection(const Ray& ray)
     return closest_hit;
 }
 
+// Find the closest intersection for the primary ray through pixel_index,
+// taking mesh triangles from the visibility buffer and tracing the ray
+// against everything that was not rasterized.
+Hit Render_World::Primary_Intersection(const Ray& ray,const ivec2& pixel_index)
+{
+    Hit closest_hit;
+    closest_hit = {nullptr, 0, 0};
+    double min_t = std::numeric_limits<double>::max();
+
+    // Near the edge of a triangle, the rasterizer and the ray intersection
+    // test may disagree about whether it is hit, so trace the ray.
+    if (visibility.Near_Edge(pixel_index)) {
+        return Closest_Intersection(ray);
+    }
+
+    const Projected_Triangle* tri = visibility.Lookup(pixel_index);
+    if (tri) {
+        // The ray test also rejects triangles seen almost edge on, which
+        // the rasterizer keeps.
+        closest_hit = tri->obj->Intersection(ray, tri->part);
+        if (closest_hit.object == nullptr) {
+            return Closest_Intersection(ray);
+        }
+        min_t = closest_hit.dist;
+    }
+
+    const std::vector<Entry>& entries = visibility.traced.entries;
+    std::vector<int> candidates;
+    if (!disable_hierarchy) {
+        visibility.traced.Intersection_Candidates(ray, candidates);
+    } else {
+        for (size_t i = 0; i < entries.size(); ++i) candidates.push_back(i);
+    }
+    for (int idx : candidates) {
+        Hit hit = entries[idx].obj->Intersection(ray, entries[idx].part);
+        if (hit.object != nullptr && hit.dist >= small_t && hit.dist < min_t) {
+            min_t = hit.dist;
+            closest_hit = hit;
+        }
+    }
+
+    return closest_hit;
+}
+
 // set up the initial view ray and call
 void Render_World::Render_Pixel(const ivec2& pixel_index)
 {
@@ -69,18 +114,35 @@ void Render_World::Render_Pixel(const ivec2& pixel_index)
     // DONE; //set up ray start and direction
     ray.endpoint = camera.position;
     ray.direction = (camera.World_Position(pixel_index) - camera.position).normalized();
-    vec3 color=Cast_Ray(ray,recursion_depth_limit);
+    vec3 color;
+    if(raster_primary && recursion_depth_limit>0)
+        color=Shade_Hit(ray,Primary_Intersection(ray,pixel_index),recursion_depth_limit);
+    else
+        color=Cast_Ray(ray,recursion_depth_limit);
 
     camera.Set_Pixel(pixel_index,Pixel_Color(color));
 }
 
 void Render_World::Render()
 {
-    if(!disable_hierarchy)
+    camera.Set_Window(ivec2(),camera.number_pixels);
+    visibility.projected=false;
+    Render_Window();
+}
+
+// Render the pixels in the camera's current window.
+void Render_World::Render_Window()
+{
+    // The hierarchy only depends on the objects, so a world that is rendered
+    // more than once (see Scene_Cache) only needs to build it the first time.
+    if(!disable_hierarchy && hierarchy.tree.empty())
         Initialize_Hierarchy(); //ignore this untill the last 2 test cases
 
-    for(int j=0;j<camera.number_pixels[1];j++)
-        for(int i=0;i<camera.number_pixels[0];i++) {
+    if(raster_primary)
+        visibility.Rasterize(*this);
+
+    for(int j=camera.window_lo[1];j<camera.window_hi[1];j++)
+        for(int i=camera.window_lo[0];i<camera.window_hi[0];i++) {
             Render_Pixel(ivec2(i,j));
 
         }
@@ -96,6 +158,19 @@ vec3 Render_World::Cast_Ray(const Ray& ray,int recursion_depth)
         std::cout << "[Cast_Ray] Ray direction: (" << ray.direction[0] << ", " << ray.direction[1] << ", " << ray.direction[2] << ")" << std::endl;
     }
     vec3 color;
+
+    // Stop tracing rays that can no longer noticeably affect the pixel.
+    if (ray.weight < min_ray_weight) {
+        if (!russian_roulette) {
+            return vec3(0, 0, 0);
+        }
+        double survival = ray.weight / min_ray_weight;
+        if (std::uniform_real_distribution<double>(0, 1)(random_engine) >= survival) {
+            return vec3(0, 0, 0);
+        }
+        Ray survivor(ray.endpoint, ray.direction, min_ray_weight);
+        return Cast_Ray(survivor, recursion_depth) / survival;
+    }
     // std::cout << "recursion_depth:"<<recursion_depth << std::endl;
     // DONE; //fill color with casted ray result;
     if (recursion_depth <= 0) {
@@ -107,7 +182,13 @@ vec3 Render_World::Cast_Ray(const Ray& ray,int recursion_depth)
     }
 
 
-    Hit hit = Closest_Intersection(ray);
+    return Shade_Hit(ray, Closest_Intersection(ray), recursion_depth);
+}
+
+// Return the color seen along ray, given its closest intersection.
+vec3 Render_World::Shade_Hit(const Ray& ray,const Hit& hit,int recursion_depth)
+{
+    vec3 color;
     if (hit.object == nullptr) {
         if (background_shader != nullptr) {
             color = background_shader->Shade_Surface(ray, vec3(0, 0, 0), vec3(0, 0, 0), 0);
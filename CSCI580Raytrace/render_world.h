@@ -1,10 +1,12 @@
 #ifndef __RENDER_WORLD_H__
 #define __RENDER_WORLD_H__
 
+#include <random>
 #include <vector>
 #include "camera.h"
 #include "hierarchy.h"
 #include "object.h"
+#include "visibility_buffer.h"
 
 class Light;
 class Shader;
@@ -16,6 +18,7 @@ public:
     Camera camera;
 
     Shader *background_shader;
+    std::vector<Shader*> shaders; // every shader, including background_shader; owned
     std::vector<Object*> objects;
     std::vector<Light*> lights;
     vec3 ambient_color;
@@ -25,16 +28,33 @@ public:
     int recursion_depth_limit;
     double small_t = 1e-4;
 
+    // Rays whose weight falls below min_ray_weight are not traced.  With
+    // russian_roulette, such rays are instead traced with probability
+    // weight/min_ray_weight and their color scaled up to compensate, which
+    // keeps the image unbiased but makes it random.
+    double min_ray_weight;
+    bool russian_roulette;
+    std::minstd_rand random_engine;
+
     Hierarchy hierarchy;
 
+    // If set, primary rays find mesh triangles by rasterizing them into
+    // visibility rather than by tracing.  Shadow and reflected rays are
+    // traced as usual.
+    bool raster_primary;
+    Visibility_Buffer visibility;
+
     Render_World();
     ~Render_World();
 
     void Render_Pixel(const ivec2& pixel_index);
     void Render();
+    void Render_Window();
     void Initialize_Hierarchy();
 
     vec3 Cast_Ray(const Ray& ray,int recursion_depth);
+    vec3 Shade_Hit(const Ray& ray,const Hit& hit,int recursion_depth);
     Hit Closest_Intersection(const Ray& ray);
+    Hit Primary_Intersection(const Ray& ray,const ivec2& pixel_index);
 };
 #endif
@@ -0,0 +1,122 @@
+#include <fstream>
+#include <sstream>
+#include <sys/stat.h>
+#include "scene_cache.h"
+
+bool Parse(Render_World& world,int& width,int& height,const char* test_file,std::string& error);
+
+// Return the version of file, with a size of -1 if it does not exist.
+static File_Version Version(const std::string& file)
+{
+    File_Version v={-1,-1,-1};
+    struct stat st;
+    if(stat(file.c_str(),&st)) return v;
+#ifdef __APPLE__
+    v.seconds=st.st_mtimespec.tv_sec;
+    v.nanoseconds=st.st_mtimespec.tv_nsec;
+#elif defined(_WIN32)
+    // Windows only reports whole seconds, so the size has to catch a file
+    // that is rewritten within the same second.
+    v.seconds=st.st_mtime;
+    v.nanoseconds=0;
+#else
+    v.seconds=st.st_mtim.tv_sec;
+    v.nanoseconds=st.st_mtim.tv_nsec;
+#endif
+    v.size=st.st_size;
+    return v;
+}
+
+// List the scene file followed by the mesh files that it references.
+static std::vector<std::string> Scene_Files(const std::string& file)
+{
+    std::vector<std::string> files(1,file);
+    std::ifstream fin(file.c_str());
+    std::string line,item,name;
+    while(getline(fin,line))
+    {
+        std::stringstream ss(line);
+        if(ss>>item && item=="mesh" && ss>>name)
+            files.push_back(name);
+    }
+    return files;
+}
+
+void Cached_Scene::Reset()
+{
+    world.min_ray_weight=min_ray_weight;
+    world.random_engine.seed(std::minstd_rand::default_seed);
+
+    Camera& camera=world.camera;
+    camera.position=position;
+    camera.film_position=film_position;
+    camera.look_vector=look_vector;
+    camera.vertical_vector=vertical_vector;
+    camera.horizontal_vector=horizontal_vector;
+    camera.image_size=image_size;
+    camera.Set_Resolution(ivec2(width,height));
+}
+
+Scene_Cache::~Scene_Cache()
+{
+    for(std::list<Cached_Scene*>::iterator it=scenes.begin();it!=scenes.end();++it)
+        delete *it;
+}
+
+Cached_Scene* Scene_Cache::Lookup(const std::string& file,std::string& error)
+{
+    if(Version(file).size<0)
+    {
+        error="Failed to open file '"+file+"'";
+        return 0;
+    }
+
+    for(std::list<Cached_Scene*>::iterator it=scenes.begin();it!=scenes.end();++it)
+    {
+        Cached_Scene* scene=*it;
+        if(scene->files[0]!=file) continue;
+
+        bool stale=false;
+        for(size_t i=0;i<scene->files.size() && !stale;i++)
+            stale=Version(scene->files[i])!=scene->versions[i];
+
+        scenes.erase(it);
+        if(!stale)
+        {
+            scenes.push_front(scene);
+            return scene;
+        }
+        delete scene;
+        break;
+    }
+
+    // Record the versions before parsing, so that a file that
+    // changes while we are reading it is picked up on the next lookup.
+    Cached_Scene* scene=new Cached_Scene;
+    scene->files=Scene_Files(file);
+    for(size_t i=0;i<scene->files.size();i++)
+        scene->versions.push_back(Version(scene->files[i]));
+
+    if(!Parse(scene->world,scene->width,scene->height,file.c_str(),error))
+    {
+        delete scene;
+        return 0;
+    }
+
+    const Camera& camera=scene->world.camera;
+    scene->position=camera.position;
+    scene->film_position=camera.film_position;
+    scene->look_vector=camera.look_vector;
+    scene->vertical_vector=camera.vertical_vector;
+    scene->horizontal_vector=camera.horizontal_vector;
+    scene->image_size=camera.image_size;
+    scene->min_ray_weight=scene->world.min_ray_weight;
+
+    scenes.push_front(scene);
+    while(scenes.size()>capacity && scenes.size()>1)
+    {
+        delete scenes.back();
+        scenes.pop_back();
+    }
+    return scene;
+}
@@ -0,0 +1,64 @@
+#ifndef __SCENE_CACHE_H__
+#define __SCENE_CACHE_H__
+
+#include <list>
+#include <string>
+#include <vector>
+#include "render_world.h"
+
+// What a scene file or mesh looked like on disk when it was parsed.  The
+// modification time is kept to the nanosecond, and the size is kept as well,
+// so that a file rewritten within the same second is still noticed.  A file
+// that does not exist has a size of -1.
+struct File_Version
+{
+    long long seconds,nanoseconds,size;
+
+    bool operator==(const File_Version& v) const
+    {return seconds==v.seconds && nanoseconds==v.nanoseconds && size==v.size;}
+    bool operator!=(const File_Version& v) const
+    {return !(*this==v);}
+};
+
+// A scene that has been parsed from disk, along with its meshes and (once it
+// has been rendered) its hierarchy.  The camera and min_ray_weight as set up by
+// the scene file are remembered so that the overrides of one job do not leak
+// into the next.
+struct Cached_Scene
+{
+    std::vector<std::string> files; // scene file followed by its meshes
+    std::vector<File_Version> versions; // version of each file
+    Render_World world;
+    int width,height;
+
+    vec3 position,film_position,look_vector,vertical_vector,horizontal_vector;
+    vec2 image_size;
+    double min_ray_weight;
+
+    // Restore the camera and min_ray_weight to the way they were set up by the
+    // scene file, and reseed the random engine, so that a job renders the
+    // same image whatever jobs came before it.
+    void Reset();
+};
+
+// Least recently used cache of parsed scenes, keyed by the scene file name and
+// the versions of the scene file and every mesh it loads.
+class Scene_Cache
+{
+public:
+    size_t capacity;
+    std::list<Cached_Scene*> scenes; // most recently used first
+
+    Scene_Cache(size_t capacity_input)
+        :capacity(capacity_input)
+    {}
+
+    ~Scene_Cache();
+
+    // Return the scene stored in file, parsing it if it is not cached or if
+    // any of its files have changed on disk.  Returns null, with a message in
+    // error, if the scene or one of its meshes cannot be read or parsed;
+    // nothing is cached for it then.
+    Cached_Scene* Lookup(const std::string& file,std::string& error);
+};
+#endif
@@ -0,0 +1,147 @@
+#include <algorithm>
+#include <cmath>
+#include "mesh.h"
+#include "render_world.h"
+#include "visibility_buffer.h"
+
+// Rasterization works with the barycentric weights of the point where the ray
+// through the pixel center meets the triangle's plane, which are the weights
+// that the ray intersection test checks against weight_tolerance.  A triangle
+// is kept at a pixel if all of its weights are at least raster_tolerance.  A
+// pixel where some triangle has a weight within raster_tolerance of an edge,
+// inside or out, is marked to be traced instead, since rounding may make the
+// two tests disagree there.  raster_tolerance is much larger than both
+// weight_tolerance and that rounding, so every other pixel gets the same
+// triangle from rasterization as from tracing.
+static const double raster_tolerance = 1e-2;
+
+// Twice the signed area of the triangle abc.
+static double Edge(const vec2& a,const vec2& b,const vec2& c)
+{
+    return (b[0]-a[0])*(c[1]-a[1])-(b[1]-a[1])*(c[0]-a[0]);
+}
+
+void Visibility_Buffer::Project(const Render_World& world)
+{
+    if(projected) return;
+    projected=true;
+
+    const Camera& camera=world.camera;
+    triangles.clear();
+    traced.entries.clear();
+    traced.tree.clear();
+
+    double focal_distance=dot(camera.film_position-camera.position,camera.look_vector);
+    for(size_t i=0;i<world.objects.size();i++)
+    {
+        Object* obj=world.objects[i];
+        const Mesh* mesh=dynamic_cast<const Mesh*>(obj);
+        for(int p=0;p<obj->number_parts;p++)
+        {
+            Entry e={obj,p,obj->Bounding_Box(p)};
+            if(!mesh)
+            {
+                traced.entries.push_back(e);
+                continue;
+            }
+
+            vec3 v[3];
+            mesh->Triangle_Vertices(p,v[0],v[1],v[2]);
+
+            Projected_Triangle t;
+            t.obj=obj;
+            t.part=p;
+            for(int k=0;k<3;k++)
+            {
+                vec3 d=v[k]-camera.position;
+                double z=dot(d,camera.look_vector);
+                vec2 film(dot(d,camera.horizontal_vector),dot(d,camera.vertical_vector));
+                film*=focal_distance/z;
+                t.corners[k]=(film-camera.min)/camera.pixel_size;
+                t.inverse_depth[k]=1/z;
+            }
+
+            // The pixels where the triangle has weights of at least
+            // -raster_tolerance are those covered by the triangle grown
+            // about its centroid to have those weights at its corners.
+            // This reaches beyond the triangle's own bounding box, most of
+            // all next to a near edge opposite a far corner.
+            vec3 centroid=(v[0]+v[1]+v[2])/3.0;
+            int in_front=0;
+            for(int k=0;k<3;k++)
+            {
+                vec3 d=centroid+(v[k]-centroid)*(1+3*raster_tolerance)-camera.position;
+                double z=dot(d,camera.look_vector);
+                if(z>small_t) in_front++;
+                vec2 film(dot(d,camera.horizontal_vector),dot(d,camera.vertical_vector));
+                vec2 corner=(film*(focal_distance/z)-camera.min)/camera.pixel_size;
+                for(int a=0;a<2;a++)
+                {
+                    t.box_lo[a]=k?std::min(t.box_lo[a],corner[a]):corner[a];
+                    t.box_hi[a]=k?std::max(t.box_hi[a],corner[a]):corner[a];
+                }
+            }
+
+            // Triangles behind the camera are never seen by primary rays.
+            // Triangles that cross the plane of the camera, once grown,
+            // cannot be projected, so they are traced instead.
+            if(in_front==3) triangles.push_back(t);
+            else if(in_front>0) traced.entries.push_back(e);
+        }
+    }
+
+    traced.Reorder_Entries();
+    traced.Build_Tree();
+}
+
+void Visibility_Buffer::Rasterize(const Render_World& world)
+{
+    Project(world);
+
+    lo=world.camera.window_lo;
+    hi=world.camera.window_hi;
+    int width=hi[0]-lo[0];
+    nearest.assign(width*(hi[1]-lo[1]),0);
+    inverse_depth.assign(nearest.size(),0);
+    near_edge.assign(nearest.size(),false);
+
+    for(size_t n=0;n<triangles.size();n++)
+    {
+        const Projected_Triangle& t=triangles[n];
+        const vec2* c=t.corners;
+        double area=Edge(c[0],c[1],c[2]);
+        if(area==0) continue;
+
+        // Pixel (i,j) is sampled at (i+.5,j+.5).
+        int i0=std::max(lo[0],(int)std::floor(t.box_lo[0]-.5));
+        int i1=std::min(hi[0]-1,(int)std::floor(t.box_hi[0]-.5)+1);
+        int j0=std::max(lo[1],(int)std::floor(t.box_lo[1]-.5));
+        int j1=std::min(hi[1]-1,(int)std::floor(t.box_hi[1]-.5)+1);
+
+        for(int j=j0;j<=j1;j++)
+            for(int i=i0;i<=i1;i++)
+            {
+                // Image space weights, which are corrected for perspective
+                // below to give the weights on the triangle itself.
+                vec2 p(i+.5,j+.5);
+                double a=Edge(p,c[1],c[2])/area*t.inverse_depth[0];
+                double b=Edge(c[0],p,c[2])/area*t.inverse_depth[1];
+                double g=Edge(c[0],c[1],p)/area*t.inverse_depth[2];
+                double iz=a+b+g;
+                double min_weight=std::min(std::min(a,b),g)/iz;
+                if(min_weight<-raster_tolerance) continue;
+
+                int index=(j-lo[1])*width+i-lo[0];
+                if(min_weight<raster_tolerance)
+                {
+                    near_edge[index]=true;
+                    continue;
+                }
+                if(iz>inverse_depth[index])
+                {
+                    inverse_depth[index]=iz;
+                    nearest[index]=&t;
+                }
+            }
+    }
+}
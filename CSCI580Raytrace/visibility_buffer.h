@@ -0,0 +1,73 @@
+#ifndef __VISIBILITY_BUFFER_H__
+#define __VISIBILITY_BUFFER_H__
+
+#include <vector>
+#include "hierarchy.h"
+
+class Render_World;
+
+// A mesh triangle projected onto the image.  x and y are in pixel units, with
+// the center of pixel (i,j) at (i+.5,j+.5); inverse_depth is one over the
+// depth along the look vector, which varies linearly across the image.
+struct Projected_Triangle
+{
+    Object* obj;
+    int part;
+    vec2 corners[3];
+    double inverse_depth[3];
+    vec2 box_lo,box_hi; // bounds of the pixels that may be near the triangle
+};
+
+/*
+  Primary visibility found by rasterization rather than ray tracing.
+
+  Mesh triangles are projected onto the image and z-buffered at the pixel
+  centers, which records for each pixel the nearest triangle covering it.
+  Pixels close to the edge of any triangle are marked near_edge and traced,
+  so that the result is the same as tracing every primary ray.
+  Everything that cannot be rasterized (spheres, planes and triangles that
+  cross the plane of the camera) is kept in a separate hierarchy that
+  primary rays are still traced against.  Only primary rays use this;
+  shadow and reflected rays are traced as usual.
+*/
+class Visibility_Buffer
+{
+public:
+    std::vector<Projected_Triangle> triangles;
+    Hierarchy traced;
+
+    // Pixels covered by the buffer: [lo,hi)
+    ivec2 lo,hi;
+    std::vector<const Projected_Triangle*> nearest; // null where nothing was rasterized
+    std::vector<double> inverse_depth;
+    std::vector<bool> near_edge; // pixels that must be traced
+
+    // Whether triangles and traced are up to date.  Cleared whenever the
+    // camera may have changed; see Render_World::Render.
+    bool projected;
+
+    Visibility_Buffer()
+        :projected(false)
+    {}
+
+    // Rasterize the triangles that cover the camera's current window.
+    void Rasterize(const Render_World& world);
+
+    // Nearest rasterized triangle at pixel, or null if there is none.
+    const Projected_Triangle* Lookup(const ivec2& pixel) const
+    {
+        return nearest[(pixel[1]-lo[1])*(hi[0]-lo[0])+pixel[0]-lo[0]];
+    }
+
+    // Whether the primary ray through pixel must be traced against everything.
+    bool Near_Edge(const ivec2& pixel) const
+    {
+        return near_edge[(pixel[1]-lo[1])*(hi[0]-lo[0])+pixel[0]-lo[0]];
+    }
+
+private:
+    // Project every mesh triangle for the current camera and split off the
+    // parts that must be traced.
+    void Project(const Render_World& world);
+};
+#endif
@@ -0,0 +1,49 @@
+#include <cstdio>
+#include "buffer_file.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+mapped_file::~mapped_file()
+{
+#ifndef _WIN32
+    if(mapped) munmap((void*)data, size);
+#endif
+}
+
+bool mapped_file::open(const char* filename)
+{
+#ifndef _WIN32
+    int fd=::open(filename, O_RDONLY);
+    if(fd<0) return false;
+    struct stat st;
+    if(fstat(fd, &st)==0 && st.st_size>0)
+    {
+        void* p=mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(p!=MAP_FAILED)
+        {
+            madvise(p, st.st_size, MADV_SEQUENTIAL);
+            data=(const char*)p;
+            size=st.st_size;
+            mapped=true;
+            close(fd);
+            return true;
+        }
+    }
+    close(fd);
+#endif
+    FILE* F=fopen(filename, "rb");
+    if(!F) return false;
+    char buff[1<<16];
+    size_t n;
+    while((n=fread(buff, 1, sizeof(buff), F))>0)
+        copy.insert(copy.end(), buff, buff+n);
+    fclose(F);
+    data=copy.data();
+    size=copy.size();
+    return true;
+}
@@ -0,0 +1,48 @@
+#ifndef __BUFFER_FILE__
+#define __BUFFER_FILE__
+
+#include <cstddef>
+#include <vector>
+
+// Binary vertex and index buffers, read by the vertex_buffer and index_buffer
+// commands and written by make_buffers.  A buffer file is a buffer_header
+// followed by count records of width values each, in the byte order of the
+// machine: floats for a vertex buffer, where width is floats_per_vertex, and
+// ints for an index buffer, where width is 3.  The data starts 16 bytes into
+// the file, so it is suitably aligned when the file is mapped.
+struct buffer_header
+{
+    char magic[4];
+    int width;
+    int count;
+    int reserved;
+};
+
+static const char VERTEX_BUFFER_MAGIC[4] = {'G','V','B','1'};
+static const char INDEX_BUFFER_MAGIC[4] = {'G','I','B','1'};
+
+// A file mapped into memory read-only.  Where memory mapping is not available
+// (on _WIN32) or fails, the file is read into memory instead.
+class mapped_file
+{
+public:
+    mapped_file() {}
+    ~mapped_file();
+
+    // Map the file, returning false if it cannot be opened.
+    bool open(const char* filename);
+
+    const char* begin() const {return data;}
+    const char* end() const {return data+size;}
+
+private:
+    mapped_file(const mapped_file&);
+    mapped_file& operator=(const mapped_file&);
+
+    const char* data = 0;
+    size_t size = 0;
+    bool mapped = false;
+    std::vector<char> copy;
+};
+
+#endif
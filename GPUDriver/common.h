@@ -92,11 +92,49 @@ struct data_output
     // int gl_SampleMask[];
 };
 
+// Number of vertices processed by one call to a batched vertex shader.
+static const int VERTEX_BATCH_SIZE = 8;
+
+// The input to a batched vertex shader: count vertices (at most
+// VERTEX_BATCH_SIZE), stored as structure of arrays.  data[k][i] is float k of
+// vertex i.  Entries for i >= count hold unspecified but finite values, so the
+// shader may simply process all VERTEX_BATCH_SIZE vertices.
+struct data_vertex_batch
+{
+    int count;
+    float data[MAX_FLOATS_PER_VERTEX][VERTEX_BATCH_SIZE];
+};
+
+// The output of a batched vertex shader, laid out like data_vertex_batch.
+// gl_Position[c][i] is component c of the position of vertex i.
+struct data_geometry_batch
+{
+    float gl_Position[4][VERTEX_BATCH_SIZE];
+    float data[MAX_FLOATS_PER_VERTEX][VERTEX_BATCH_SIZE];
+};
+
 // Signatures for vertex shaders and fragment shaders.
 typedef void (*shader_v)(const data_vertex&, data_geometry&,const float *);
 
+// Signature for batched vertex shaders, which shade a whole batch of vertices
+// per call.  A batched shader must compute exactly what the corresponding
+// shader_v would for each vertex.
+typedef void (*shader_v_batch)(const data_vertex_batch&, data_geometry_batch&,const float *);
+
 typedef void (*shader_f)(const data_fragment&, data_output&,const float *);
 
+// What the driver may assume about a fragment shader.  Bit k of
+// attributes_read is set if the shader reads in.data[k]; attributes that are
+// not read are not interpolated.  A constant shader's output depends only on
+// the uniform data, so it is the same for every fragment of a render and is
+// only computed once.  Shaders without registered information are assumed to
+// read everything and not be constant.
+struct fragment_shader_info
+{
+    unsigned long long attributes_read;
+    bool constant;
+};
+
 // Different interpolation strategies that may be used to interpolate data from
 // triangle vertices to the pixels (fragments) inside the triangle.
 enum class interp_type {invalid, flat, smooth, noperspective};
@@ -1,8 +1,19 @@
 #include "driver_state.h"
+#include "thread_pool.h"
+#include <cfloat>
+#include <cmath>
+#include <cstdlib>
 #include <cstring>
 #include <limits>
 #include <algorithm>
 
+// The vectorized rasterizer is compiled for AVX2 and used only if the
+// processor running the driver supports it.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DRIVER_USE_AVX2
+#include <immintrin.h>
+#endif
+
 driver_state::driver_state()
 {
 }
@@ -11,23 +22,264 @@ driver_state::~driver_state()
 {
     delete [] image_color;
     delete [] image_depth;
+    delete threads;
+}
+
+// Compute the range of pixels [min_x,max_x] x [min_y,max_y] that may be
+// covered by a clipped triangle, clamped to the screen.
+static void pixel_bounds(const driver_state& state, const data_geometry& v0,
+    const data_geometry& v1, const data_geometry& v2,
+    int& min_x, int& max_x, int& min_y, int& max_y)
+{
+    // Convert NDC coordinates (-1 to 1) to screen pixel coordinates
+    float x0 = (v0.gl_Position[0] / v0.gl_Position[3] + 1.0f) * 0.5f * state.image_width;
+    float y0 = (v0.gl_Position[1] / v0.gl_Position[3] + 1.0f) * 0.5f * state.image_height;
+    float x1 = (v1.gl_Position[0] / v1.gl_Position[3] + 1.0f) * 0.5f * state.image_width;
+    float y1 = (v1.gl_Position[1] / v1.gl_Position[3] + 1.0f) * 0.5f * state.image_height;
+    float x2 = (v2.gl_Position[0] / v2.gl_Position[3] + 1.0f) * 0.5f * state.image_width;
+    float y2 = (v2.gl_Position[1] / v2.gl_Position[3] + 1.0f) * 0.5f * state.image_height;
+
+    // Calculate bounding box with proper rounding to include edge pixels
+    // Since we sample at pixel center (x + 0.5), we need to account for this offset
+    // Pixel at index x has center at x + 0.5
+    // To include all pixels that might be covered, we need to consider pixel centers
+    float min_xf = std::min({x0, x1, x2});
+    float max_xf = std::max({x0, x1, x2});
+    float min_yf = std::min({y0, y1, y2});
+    float max_yf = std::max({y0, y1, y2});
+
+    // For min: floor(min - 0.5) gives the smallest pixel index whose center (x+0.5) might be >= min
+    // For max: floor(max - 0.5) + 1 gives the largest pixel index whose center might be <= max
+    min_x = std::max(0, (int)std::floor(min_xf - 0.5f));
+    max_x = std::min(state.image_width - 1, (int)std::floor(max_xf - 0.5f) + 1);
+    min_y = std::max(0, (int)std::floor(min_yf - 0.5f));
+    max_y = std::min(state.image_height - 1, (int)std::floor(max_yf - 0.5f) + 1);
+}
+
+// Rasterize the part of a triangle that lies within the pixels
+// [x_lo,x_hi] x [y_lo,y_hi].  See rasterize_triangle.
+static void rasterize_triangle_region(driver_state& state, const data_geometry& v0,
+    const data_geometry& v1, const data_geometry& v2,
+    int x_lo, int x_hi, int y_lo, int y_hi, int deferred_id);
+
+// Store a clipped triangle for the current render and add it to the bin of
+// every tile that its bounding box overlaps.  deferred_id is the index of the
+// triangle in deferred_triangles, or -1 if shading is not deferred.
+static void bin_triangle(driver_state& state, const data_geometry& v0,
+    const data_geometry& v1, const data_geometry& v2, int deferred_id)
+{
+    int min_x, max_x, min_y, max_y;
+    pixel_bounds(state, v0, v1, v2, min_x, max_x, min_y, max_y);
+    if (min_x > max_x || min_y > max_y) return;
+
+    int stride = 4 + state.floats_per_vertex;
+    int index = state.binned_vertices.size() / (3 * stride);
+    state.binned_ids.push_back(deferred_id);
+    const data_geometry* in[3] = {&v0, &v1, &v2};
+    for (int j = 0; j < 3; j++) {
+        for (int k = 0; k < 4; k++)
+            state.binned_vertices.push_back(in[j]->gl_Position[k]);
+        state.binned_vertices.insert(state.binned_vertices.end(),
+            in[j]->data, in[j]->data + state.floats_per_vertex);
+    }
+
+    for (int ty = min_y / TILE_SIZE; ty <= max_y / TILE_SIZE; ty++)
+        for (int tx = min_x / TILE_SIZE; tx <= max_x / TILE_SIZE; tx++)
+            state.bins[ty * state.tiles_x + tx].push_back(index);
+}
+
+// Rasterize the triangles binned during the current render.  Tiles are
+// independent, so they are handed out to the threads of the pool.
+static void rasterize_bins(driver_state& state)
+{
+    int stride = 4 + state.floats_per_vertex;
+    state.threads->run(state.tiles_x * state.tiles_y, [&state, stride](int tile) {
+        int x_lo = (tile % state.tiles_x) * TILE_SIZE;
+        int y_lo = (tile / state.tiles_x) * TILE_SIZE;
+        int x_hi = std::min(x_lo + TILE_SIZE, state.image_width) - 1;
+        int y_hi = std::min(y_lo + TILE_SIZE, state.image_height) - 1;
+
+        const std::vector<int>& bin = state.bins[tile];
+        for (size_t i = 0; i < bin.size(); i++) {
+            float* p = &state.binned_vertices[bin[i] * 3 * stride];
+            data_geometry v[3];
+            for (int j = 0; j < 3; j++, p += stride) {
+                v[j].gl_Position = vec4(p[0], p[1], p[2], p[3]);
+                v[j].data = p + 4;
+            }
+            rasterize_triangle_region(state, v[0], v[1], v[2], x_lo, x_hi, y_lo, y_hi,
+                state.binned_ids[bin[i]]);
+        }
+    });
+}
+
+// Run the vertex shader on the count (at most VERTEX_BATCH_SIZE) vertices
+// listed in indices, storing the results in the vertex cache.  With a batched
+// shader, the vertices are transposed into structure of arrays form, shaded
+// with one call, and transposed back.  Otherwise each is shaded on its own.
+static void shade_vertex_batch(driver_state& state, const int* indices, int count,
+    data_vertex_batch& in, data_geometry_batch& out)
+{
+    int fpv = state.floats_per_vertex;
+    if (!state.vertex_shader_batch) {
+        for (int i = 0; i < count; i++) {
+            data_vertex input_vertex;
+            input_vertex.data = &state.vertex_data[indices[i] * fpv];
+            state.vertex_shader(input_vertex, state.shaded_vertices[indices[i]], state.uniform_data);
+        }
+        return;
+    }
+
+    in.count = count;
+    for (int i = 0; i < count; i++) {
+        const float* v = &state.vertex_data[indices[i] * fpv];
+        for (int k = 0; k < fpv; k++)
+            in.data[k][i] = v[k];
+    }
+    state.vertex_shader_batch(in, out, state.uniform_data);
+    for (int i = 0; i < count; i++) {
+        data_geometry& g = state.shaded_vertices[indices[i]];
+        g.gl_Position = vec4(out.gl_Position[0][i], out.gl_Position[1][i],
+            out.gl_Position[2][i], out.gl_Position[3][i]);
+        for (int k = 0; k < fpv; k++)
+            g.data[k] = out.data[k][i];
+    }
+}
+
+// Fill the vertex cache for the current render.  Indexed renders only shade
+// the vertices that some triangle refers to; all others use every vertex.
+static void shade_vertices(driver_state& state, render_type type)
+{
+    int fpv = state.floats_per_vertex;
+    state.shaded_vertices.resize(state.num_vertices);
+    state.shaded_data.resize(state.num_vertices * fpv);
+    for (int i = 0; i < state.num_vertices; i++)
+        state.shaded_vertices[i].data = &state.shaded_data[i * fpv];
+
+    state.vertex_used.assign(state.num_vertices, type != render_type::indexed);
+    if (type == render_type::indexed)
+        for (int i = 0; i < 3 * state.num_triangles; i++)
+            state.vertex_used[state.index_data[i]] = 1;
+
+    // Batch inputs past the last vertex are left as zero, so that they are
+    // finite.  Outputs are zeroed so that floats a shader does not write are
+    // finite too.
+    data_vertex_batch in = {};
+    data_geometry_batch out = {};
+    int batch[VERTEX_BATCH_SIZE];
+    int count = 0;
+    for (int i = 0; i < state.num_vertices; i++) {
+        if (!state.vertex_used[i]) continue;
+        batch[count++] = i;
+        if (count == VERTEX_BATCH_SIZE) {
+            shade_vertex_batch(state, batch, count, in, out);
+            count = 0;
+        }
+    }
+    if (count) shade_vertex_batch(state, batch, count, in, out);
+}
+
+// Evaluate a constant fragment shader, returning the pixel it writes.  It
+// reads no attributes, so it is given zeros.
+static pixel shade_constant(const driver_state& state)
+{
+    float data[MAX_FLOATS_PER_VERTEX] = {};
+    data_fragment frag_data{ data };
+    data_output output_data;
+    state.fragment_shader(frag_data, output_data, state.uniform_data);
+    int rgb[3];
+    for (int c = 0; c < 3; c++)
+        rgb[c] = std::max(0, std::min(255, (int)(output_data.output_color[c] * 255.0f)));
+    return make_pixel(rgb[0], rgb[1], rgb[2]);
 }
 
 // This function should allocate and initialize the arrays that store color and
 // depth.  This is not done during the constructor since the width and height
 // are not known when this class is constructed.
+//
+// It may be called again to start a new frame.  Each array is then kept if
+// it already has the size that the image size and options (msaa, deferred)
+// need, and clearing them only marks every block as cleared (see
+// block_cleared).  Renders whose shading was deferred but not yet finished
+// are discarded.
 void initialize_render(driver_state& state, int width, int height)
 {
-    state.image_width=width;
-    state.image_height=height;
+    if (!state.image_color || width != state.image_width || height != state.image_height) {
+        state.image_width=width;
+        state.image_height=height;
+
+        // The buffers are padded to a whole number of tiles; see pixel_index.
+        state.blocks_x = (width + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        int blocks_y = (height + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        int size = state.blocks_x * blocks_y * BLOCK_SIZE * BLOCK_SIZE;
+        state.framebuffer_size = size;
 
-    state.image_color = new pixel[width*height];
-    state.image_depth=new float[width*height];
+        delete [] state.image_color;
+        delete [] state.image_depth;
+        state.image_color = new pixel[size];
+        state.image_depth=new float[size];
+        state.block_max_depth.resize(state.blocks_x * blocks_y);
+    }
 
-    // Initialize depth buffer to maximum depth (far plane)
-    for (int i = 0; i < width * height; i++) {
-        state.image_depth[i] = std::numeric_limits<float>::max();
+    // The options may have changed since the last frame, even if the size
+    // has not.
+    size_t size = state.framebuffer_size;
+    if (state.msaa && state.sample_depth.size() != MSAA_SAMPLES * size) {
+        state.sample_depth.resize(MSAA_SAMPLES * size);
+        state.sample_slot.resize(size);
+        state.sample_pools.resize(state.block_max_depth.size());
+    }
+    if (!state.deferred) {
+        state.visible_triangle.clear();
+        state.visible_bary.clear();
+    }
+    else if (state.visible_triangle.size() != size) {
+        state.visible_triangle.assign(size, -1);
+        state.visible_bary.resize(3 * size);
     }
+
+    std::fill(state.block_max_depth.begin(), state.block_max_depth.end(), std::numeric_limits<float>::max());
+    state.block_cleared.assign(state.block_max_depth.size(), 1);
+
+    state.deferred_draws.clear();
+    state.deferred_vertices.clear();
+    state.deferred_triangles.clear();
+}
+
+// Whether the block containing pixel (x,y) is cleared; see block_cleared.
+static bool pixel_cleared(const driver_state& state, int x, int y)
+{
+    return state.block_cleared[(y / BLOCK_SIZE) * state.blocks_x + x / BLOCK_SIZE];
+}
+
+// Reset the pixels of a block if it is cleared, before drawing to it.
+static void prepare_block(driver_state& state, int block)
+{
+    if (!state.block_cleared[block]) return;
+    state.block_cleared[block] = 0;
+
+    // Blocks are the tiles of the framebuffer; see pixel_index.
+    const int n = BLOCK_SIZE * BLOCK_SIZE;
+    int base = block * n;
+    std::fill(state.image_color + base, state.image_color + base + n, make_pixel(0, 0, 0));
+    std::fill(state.image_depth + base, state.image_depth + base + n, std::numeric_limits<float>::max());
+    if (state.msaa) {
+        std::fill(&state.sample_depth[MSAA_SAMPLES * base], &state.sample_depth[MSAA_SAMPLES * base] + MSAA_SAMPLES * n,
+            std::numeric_limits<float>::max());
+        std::fill(&state.sample_slot[base], &state.sample_slot[base] + n, -1);
+        state.sample_pools[block].colors.clear();
+        state.sample_pools[block].free.clear();
+    }
+    if (!state.visible_triangle.empty())
+        std::fill(&state.visible_triangle[base], &state.visible_triangle[base] + n, -1);
+}
+
+void read_image(const driver_state& state, pixel* image)
+{
+    for (int y = 0; y < state.image_height; y++)
+        for (int x = 0; x < state.image_width; x++)
+            image[y * state.image_width + x] = pixel_cleared(state, x, y)
+                ? make_pixel(0, 0, 0) : state.image_color[pixel_index(state, x, y)];
 }
 
 // This function will be called to render the data that has been stored in this class.
@@ -46,249 +298,355 @@ void render(driver_state& state, render_type type)
     //I implement that for you but you must get the data into the function.
     //once transformed, we clip and rasterize. (skip clipping till later)
 
-    const data_geometry* tri[3];
+    // With more than one thread, clipped triangles are binned by clip_triangle
+    // and rasterized tile by tile after the switch below.
+    state.binning = state.num_threads > 1;
+    if (state.binning) {
+        if (!state.threads || state.threads->size() != state.num_threads) {
+            delete state.threads;
+            state.threads = new thread_pool(state.num_threads);
+        }
+        state.tiles_x = (state.image_width + TILE_SIZE - 1) / TILE_SIZE;
+        state.tiles_y = (state.image_height + TILE_SIZE - 1) / TILE_SIZE;
+        state.bins.resize(state.tiles_x * state.tiles_y);
+        for (size_t i = 0; i < state.bins.size(); i++)
+            state.bins[i].clear();
+        state.binned_vertices.clear();
+        state.binned_ids.clear();
+    }
+
+    // Group the attributes that the fragment shader reads by how they are
+    // interpolated.  A constant fragment shader is evaluated here, once.
+    interpolation_plan& plan = state.interpolation;
+    plan = interpolation_plan();
+    for (int k = 0; k < state.floats_per_vertex; k++) {
+        if (!(state.fragment_info.attributes_read >> k & 1)) continue;
+        switch (state.interp_rules[k]) {
+        case interp_type::smooth: plan.smooth[plan.num_smooth++] = k; break;
+        case interp_type::noperspective: plan.noperspective[plan.num_noperspective++] = k; break;
+        default: plan.flat[plan.num_flat++] = k; break;
+        }
+    }
+    if (state.fragment_info.constant)
+        state.constant_color = shade_constant(state);
+
+    // With deferred shading, keep what is needed to shade this render's
+    // pixels once all renders are done.
+    if (state.deferred) {
+        deferred_draw draw;
+        draw.fragment_shader = state.fragment_shader;
+        draw.uniform_data.assign(state.uniform_data, state.uniform_data + state.num_uniforms);
+        draw.floats_per_vertex = state.floats_per_vertex;
+        draw.interpolation = state.interpolation;
+        draw.constant = state.fragment_info.constant;
+        draw.constant_color = state.constant_color;
+        state.deferred_draws.push_back(draw);
+        if (state.visible_triangle.size() != (size_t)state.framebuffer_size) {
+            state.visible_triangle.assign(state.framebuffer_size, -1);
+            state.visible_bary.resize(3 * state.visible_triangle.size());
+        }
+    }
+
+    // Every vertex is shaded once, up front, in batches
+    shade_vertices(state, type);
+    const data_geometry* v = state.shaded_vertices.data();
+
     switch (type) {
     case render_type::triangle: {
-        //general flow is to iterate through all triangles,
-        //use floats_per_vertex to iterate through the vertex data array appropriately
-        //for each vertex in the tri, pass it into vertex shader and put the out into tri
-        //implement clipping later
-        //otherwise pass the tri into rasterize_triangle()
-        
-        // Calculate number of triangles
+        // Each group of three vertices is a triangle
         int num_triangles = state.num_vertices / 3;
-        
-        for (int i = 0; i < num_triangles; i++) {
-            // Allocate memory for transformed vertices
-            data_geometry* transformed_vertices = new data_geometry[3];
-            
-            // Process each vertex in the triangle
-            for (int j = 0; j < 3; j++) {
-                int vertex_index = i * 3 + j;
-                int data_offset = vertex_index * state.floats_per_vertex;
-                
-                // Set up input vertex data
-                data_vertex input_vertex;
-                input_vertex.data = &state.vertex_data[data_offset];
-                
-                // Set up output geometry data
-                transformed_vertices[j].data = new float[state.floats_per_vertex];
-                
-                // Call vertex shader
-                state.vertex_shader(input_vertex, transformed_vertices[j], state.uniform_data);
-            }
-            
-            // Set up triangle array for clipping
-            tri[0] = &transformed_vertices[0];
-            tri[1] = &transformed_vertices[1];
-            tri[2] = &transformed_vertices[2];
-            
-            // Call clip_triangle to handle clipping and rasterization
-            clip_triangle(state, *tri[0], *tri[1], *tri[2]);
-            // Clean up memory
-            for (int j = 0; j < 3; j++) {
-                delete[] transformed_vertices[j].data;
-            }
-            delete[] transformed_vertices;
-        }
+        for (int i = 0; i < num_triangles; i++)
+            assemble_triangle(state, v[3 * i], v[3 * i + 1], v[3 * i + 2]);
         break;
     }
     case render_type::indexed: {
-        //general flow is to iterate through all triangles,
-        //set up the tri (get the vertex data into the vertexshader)
-        //implement clipping later
-        //otherwise pass the tri into rasterize_triangle()
-        
-        for (int i = 0; i < state.num_triangles; i++) {
-            // Allocate memory for transformed vertices
-            data_geometry* transformed_vertices = new data_geometry[3];
-            
-            // Process each vertex in the triangle using index data
-            for (int j = 0; j < 3; j++) {
-                int vertex_index = state.index_data[i * 3 + j];
-                int data_offset = vertex_index * state.floats_per_vertex;
-                
-                // Set up input vertex data
-                data_vertex input_vertex;
-                input_vertex.data = &state.vertex_data[data_offset];
-                
-                // Set up output geometry data
-                transformed_vertices[j].data = new float[state.floats_per_vertex];
-                
-                // Call vertex shader
-                state.vertex_shader(input_vertex, transformed_vertices[j], state.uniform_data);
-            }
-            
-            // Set up triangle array for clipping
-            tri[0] = &transformed_vertices[0];
-            tri[1] = &transformed_vertices[1];
-            tri[2] = &transformed_vertices[2];
-            
-            // Call clip_triangle to handle clipping and rasterization
-            clip_triangle(state, *tri[0], *tri[1], *tri[2]);
-            
-            // Clean up memory
-            for (int j = 0; j < 3; j++) {
-                delete[] transformed_vertices[j].data;
-            }
-            delete[] transformed_vertices;
-        }
+        // Each group of three indices is a triangle
+        const int* index = state.index_data;
+        for (int i = 0; i < state.num_triangles; i++, index += 3)
+            assemble_triangle(state, v[index[0]], v[index[1]], v[index[2]]);
         break;
     }
     case render_type::fan: {
-        //for the testcase involving triangle fans
-        // First vertex is shared by all triangles
-        // Each subsequent vertex forms a triangle with the first vertex and the previous vertex
-        
-        if (state.num_vertices < 3) break;
-        
-        // Process the first vertex once
-        data_geometry first_vertex;
-        first_vertex.data = new float[state.floats_per_vertex];
-        data_vertex input_vertex;
-        input_vertex.data = &state.vertex_data[0];
-        state.vertex_shader(input_vertex, first_vertex, state.uniform_data);
-        
-        // Process remaining vertices to form triangles
-        for (int i = 2; i < state.num_vertices; i++) {
-            data_geometry* transformed_vertices = new data_geometry[3];
-            
-            // First vertex (shared)
-            transformed_vertices[0] = first_vertex;
-            
-            // Second vertex (previous)
-            int prev_vertex_index = i - 1;
-            int data_offset = prev_vertex_index * state.floats_per_vertex;
-            input_vertex.data = &state.vertex_data[data_offset];
-            transformed_vertices[1].data = new float[state.floats_per_vertex];
-            state.vertex_shader(input_vertex, transformed_vertices[1], state.uniform_data);
-            
-            // Third vertex (current)
-            data_offset = i * state.floats_per_vertex;
-            input_vertex.data = &state.vertex_data[data_offset];
-            transformed_vertices[2].data = new float[state.floats_per_vertex];
-            state.vertex_shader(input_vertex, transformed_vertices[2], state.uniform_data);
-            
-            // Set up triangle array for clipping
-            tri[0] = &transformed_vertices[0];
-            tri[1] = &transformed_vertices[1];
-            tri[2] = &transformed_vertices[2];
-            
-            // Call clip_triangle to handle clipping and rasterization
-            clip_triangle(state, *tri[0], *tri[1], *tri[2]);
-            
-            // Clean up memory (don't delete first vertex data yet)
-            delete[] transformed_vertices[1].data;
-            delete[] transformed_vertices[2].data;
-            delete[] transformed_vertices;
-        }
-        
-        // Clean up first vertex
-        delete[] first_vertex.data;
+        // The first vertex is shared by all triangles.  Each subsequent vertex
+        // forms a triangle with the first vertex and the previous vertex.
+        for (int i = 2; i < state.num_vertices; i++)
+            assemble_triangle(state, v[0], v[i - 1], v[i]);
         break;
     }
     case render_type::strip: {
-        //for the testcase involving triangle strips
-        // Each vertex after the first two forms a triangle with the previous two vertices
-        
-        if (state.num_vertices < 3) break;
-        
+        // Each vertex after the first two forms a triangle with the previous
+        // two vertices.  The winding of every other triangle is reversed, as
+        // in OpenGL, so that the triangles of a strip all face the same way.
         for (int i = 2; i < state.num_vertices; i++) {
-            data_geometry* transformed_vertices = new data_geometry[3];
-            
-            // Process three consecutive vertices
-            for (int j = 0; j < 3; j++) {
-                int vertex_index = i - 2 + j;
-                int data_offset = vertex_index * state.floats_per_vertex;
-                
-                data_vertex input_vertex;
-                input_vertex.data = &state.vertex_data[data_offset];
-                transformed_vertices[j].data = new float[state.floats_per_vertex];
-                state.vertex_shader(input_vertex, transformed_vertices[j], state.uniform_data);
-            }
-            
-            // Set up triangle array for clipping
-            tri[0] = &transformed_vertices[0];
-            tri[1] = &transformed_vertices[1];
-            tri[2] = &transformed_vertices[2];
-            
-            // Call clip_triangle to handle clipping and rasterization
-            clip_triangle(state, *tri[0], *tri[1], *tri[2]);
-            
-            // Clean up memory
-            for (int j = 0; j < 3; j++) {
-                delete[] transformed_vertices[j].data;
-            }
-            delete[] transformed_vertices;
+            state.reversed_winding = i % 2;
+            assemble_triangle(state, v[i - 2], v[i - 1], v[i]);
         }
+        state.reversed_winding = false;
         break;
     }
     default:
         break;
     }
+
+    if (state.binning) {
+        state.binning = false;
+        rasterize_bins(state);
+    }
 }
 
-// This function clips a triangle (defined by the three vertices in the "in" array).
-// It will be called recursively, once for each clipping face (face=0, 1, ..., 5) to
-// clip against each of the clipping faces in turn.  When face=6, clip_triangle should
-// simply pass the call on to rasterize_triangle.
-void clip_triangle(driver_state& state, const data_geometry& v0,
-    const data_geometry& v1, const data_geometry& v2,int face)
+// Shade the visible pixels of row y recorded during deferred rendering.  The
+// attributes are interpolated exactly as rasterize_triangle would have.
+static void shade_deferred_row(driver_state& state, int y)
 {
-    //this is the hardest part of the program and reccomended you do it last.
-    //we recursively check each clipping face and pass on to rasterizer
-    //NOTE: only the front and back clipping faces are strictly needed to pass the test cases
-    if(face==6)
-    {
-        rasterize_triangle(state, v0, v1, v2);
-        return;
+    float data[MAX_FLOATS_PER_VERTEX];
+    data_fragment frag_data{ data };
+    data_output output_data;
+    for (int x = 0; x < state.image_width; x++) {
+        int index = pixel_index(state, x, y);
+        if (pixel_cleared(state, x, y)) continue;
+        int visible = state.visible_triangle[index];
+        if (visible < 0) continue;
+
+        // The barycentric coordinates are in the rasterizer's vertex order
+        int id = visible / 2;
+        bool swapped = visible % 2;
+        const deferred_draw& draw = state.deferred_draws[state.deferred_triangles[id].first];
+        if (draw.constant) {
+            state.image_color[index] = draw.constant_color;
+            continue;
+        }
+        int stride = 1 + draw.floats_per_vertex;
+        const float* p = &state.deferred_vertices[state.deferred_triangles[id].second];
+        const float* bary = &state.visible_bary[3 * index];
+        const float* d[3];
+        float inv_w[3], persp[3];
+        for (int k = 0; k < 3; k++) {
+            int j = (swapped && k) ? 3 - k : k;
+            inv_w[k] = 1.0f / p[j * stride];
+            d[k] = p + j * stride + 1;
+        }
+        float G = bary[0] * inv_w[0] + bary[1] * inv_w[1] + bary[2] * inv_w[2];
+        float inv_G = 1.0f / G;
+        for (int k = 1; k < 3; k++)
+            persp[k] = bary[k] * inv_w[k] * inv_G;
+
+        const interpolation_plan& plan = draw.interpolation;
+        for (int j = 0; j < plan.num_flat; j++) {
+            int k = plan.flat[j];
+            data[k] = d[0][k];
+        }
+        for (int j = 0; j < plan.num_smooth; j++) {
+            int k = plan.smooth[j];
+            data[k] = d[0][k] + persp[1] * (d[1][k] - d[0][k]) + persp[2] * (d[2][k] - d[0][k]);
+        }
+        for (int j = 0; j < plan.num_noperspective; j++) {
+            int k = plan.noperspective[j];
+            data[k] = d[0][k] + bary[1] * (d[1][k] - d[0][k]) + bary[2] * (d[2][k] - d[0][k]);
+        }
+
+        const float* uniform_data = draw.uniform_data.empty() ? 0 : &draw.uniform_data[0];
+        draw.fragment_shader(frag_data, output_data, uniform_data);
+
+        // Convert color from [0,1] to [0,255] and write to image
+        int rgb[3];
+        for (int c = 0; c < 3; c++)
+            rgb[c] = std::max(0, std::min(255, (int)(output_data.output_color[c] * 255.0f)));
+        state.image_color[index] = make_pixel(rgb[0], rgb[1], rgb[2]);
     }
-    
-    // Helper function to check if a vertex is inside the clipping plane
-    // Clipping planes: 0=x=-w, 1=x=w, 2=y=-w, 3=y=w, 4=z=-w (near), 5=z=w (far)
-    auto is_inside = [&](const data_geometry& v) -> bool {
-        float x = v.gl_Position[0];
-        float y = v.gl_Position[1];
-        float z = v.gl_Position[2];
-        float w = v.gl_Position[3];
-        
-        switch(face) {
-            case 0: return x >= -w; // left: x >= -w
-            case 1: return x <= w;  // right: x <= w
-            case 2: return y >= -w; // bottom: y >= -w
-            case 3: return y <= w;  // top: y <= w
-            case 4: return z >= -w; // near: z >= -w
-            case 5: return z <= w;  // far: z <= w
-            default: return true;
+}
+
+// Average the samples of the expanded pixels of row y into image_color.
+static void resolve_samples_row(driver_state& state, int y)
+{
+    for (int x = 0; x < state.image_width; x++) {
+        int index = pixel_index(state, x, y);
+        if (pixel_cleared(state, x, y) || state.sample_slot[index] < 0) continue;
+        const pixel* samples = &state.sample_pools[index / (BLOCK_SIZE * BLOCK_SIZE)]
+            .colors[MSAA_SAMPLES * state.sample_slot[index]];
+        int sum[3] = {};
+        for (int s = 0; s < MSAA_SAMPLES; s++) {
+            int rgb[3];
+            from_pixel(samples[s], rgb[0], rgb[1], rgb[2]);
+            for (int c = 0; c < 3; c++) sum[c] += rgb[c];
         }
-    };
-    
-    // Helper function to get component index for clipping
-    int comp = (face < 2) ? 0 : ((face < 4) ? 1 : 2);
-    
-    // Check which vertices are inside
-    bool in0 = is_inside(v0);
-    bool in1 = is_inside(v1);
-    bool in2 = is_inside(v2);
-    
-    int inside_count = (in0 ? 1 : 0) + (in1 ? 1 : 0) + (in2 ? 1 : 0);
-    
-    // All vertices inside: pass to next face
-    if(inside_count == 3) {
-        clip_triangle(state, v0, v1, v2, face + 1);
-        return;
+        for (int c = 0; c < 3; c++)
+            sum[c] = (sum[c] + MSAA_SAMPLES / 2) / MSAA_SAMPLES;
+        state.image_color[index] = make_pixel(sum[0], sum[1], sum[2]);
+        state.sample_slot[index] = -1;
     }
-    
-    // All vertices outside: discard triangle
-    if(inside_count == 0) {
-        return;
+}
+
+// Call row(y) for every row of the image.  Rows are independent, so they are
+// processed in parallel when there are threads available.
+static void for_each_row(driver_state& state, const std::function<void(int)>& row)
+{
+    if (state.num_threads > 1 && state.threads) {
+        state.threads->run(state.image_height, row);
+    } else {
+        for (int y = 0; y < state.image_height; y++)
+            row(y);
     }
-    
-    // Helper function to interpolate vertex data
-    auto interpolate_vertex = [&](const data_geometry& v_in,
-                                  const data_geometry& v_out, float t) {
-        data_geometry v;
-        v.data = new float[state.floats_per_vertex];
+}
+
+void finish_render(driver_state& state)
+{
+    if (state.msaa) {
+        for_each_row(state, [&state](int y) {
+            resolve_samples_row(state, y);
+        });
+        // No pixel is expanded any more.
+        for (size_t i = 0; i < state.sample_pools.size(); i++) {
+            state.sample_pools[i].colors.clear();
+            state.sample_pools[i].free.clear();
+        }
+    }
+
+    if (state.deferred_draws.empty()) return;
+    for_each_row(state, [&state](int y) {
+        shade_deferred_row(state, y);
+    });
+
+    state.deferred_draws.clear();
+    state.deferred_vertices.clear();
+    state.deferred_triangles.clear();
+    std::fill(state.visible_triangle.begin(), state.visible_triangle.end(), -1);
+}
+
+// The guard band extends the view volume to |x| <= scale_x * w and
+// |y| <= scale_y * w.
+static void guard_band_scale(const driver_state& state, float& scale_x, float& scale_y)
+{
+    scale_x = 1.0f + 2.0f * GUARD_BAND / state.image_width;
+    scale_y = 1.0f + 2.0f * GUARD_BAND / state.image_height;
+}
+
+// Bits of the outcode of a vertex, one for each clipping face that it lies
+// outside of, where the left and right faces are at x = -/+ scale_x * w and
+// the bottom and top faces at y = -/+ scale_y * w.  The faces are numbered as
+// in clip_triangle.
+static int outcode(const data_geometry& v, float scale_x, float scale_y)
+{
+    float x = v.gl_Position[0];
+    float y = v.gl_Position[1];
+    float z = v.gl_Position[2];
+    float w = v.gl_Position[3];
+    return (x < -scale_x * w) | (x > scale_x * w) << 1
+        | (y < -scale_y * w) << 2 | (y > scale_y * w) << 3
+        | (z < -w) << 4 | (z > w) << 5;
+}
+
+// Whether a triangle in front of the camera (all w > 0) has zero area on the
+// screen or is a back face that should be culled.
+static bool facing_rejected(const driver_state& state, const data_geometry& v0,
+    const data_geometry& v1, const data_geometry& v2)
+{
+    float x0 = v0.gl_Position[0] / v0.gl_Position[3];
+    float y0 = v0.gl_Position[1] / v0.gl_Position[3];
+    float x1 = v1.gl_Position[0] / v1.gl_Position[3];
+    float y1 = v1.gl_Position[1] / v1.gl_Position[3];
+    float x2 = v2.gl_Position[0] / v2.gl_Position[3];
+    float y2 = v2.gl_Position[1] / v2.gl_Position[3];
+    float area = (x1 - x0) * (y2 - y0) - (y1 - y0) * (x2 - x0);
+    if (state.reversed_winding) area = -area;
+    return area == 0 || (state.cull_back_faces && area < 0);
+}
+
+// Store a triangle of the current render for deferred shading, and return its
+// index in deferred_triangles.
+static int defer_triangle(driver_state& state, const data_geometry& v0,
+    const data_geometry& v1, const data_geometry& v2)
+{
+    int id = state.deferred_triangles.size();
+    state.deferred_triangles.push_back(std::make_pair(
+        (int)state.deferred_draws.size() - 1, (int)state.deferred_vertices.size()));
+    const data_geometry* in[3] = {&v0, &v1, &v2};
+    for (int j = 0; j < 3; j++) {
+        state.deferred_vertices.push_back(in[j]->gl_Position[3]);
+        state.deferred_vertices.insert(state.deferred_vertices.end(),
+            in[j]->data, in[j]->data + state.floats_per_vertex);
+    }
+    return id;
+}
+
+// Send a triangle that lies within the view volume on to rasterization.
+static void emit_triangle(driver_state& state, const data_geometry& v0,
+    const data_geometry& v1, const data_geometry& v2)
+{
+    int deferred_id = state.deferred ? defer_triangle(state, v0, v1, v2) : -1;
+    if(state.binning)
+        bin_triangle(state, v0, v1, v2, deferred_id);
+    else
+        rasterize_triangle_region(state, v0, v1, v2,
+            0, state.image_width - 1, 0, state.image_height - 1, deferred_id);
+}
+
+void assemble_triangle(driver_state& state, const data_geometry& v0,
+    const data_geometry& v1, const data_geometry& v2)
+{
+    // All three vertices outside the same face of the view volume
+    if (outcode(v0, 1, 1) & outcode(v1, 1, 1) & outcode(v2, 1, 1)) return;
+
+    // The facing of a triangle is only meaningful once it is known to be in
+    // front of the camera.  Otherwise it is decided after clipping.
+    if (v0.gl_Position[3] > 0 && v1.gl_Position[3] > 0 && v2.gl_Position[3] > 0
+        && facing_rejected(state, v0, v1, v2))
+        return;
+
+    float scale_x, scale_y;
+    guard_band_scale(state, scale_x, scale_y);
+    if (outcode(v0, scale_x, scale_y) | outcode(v1, scale_x, scale_y)
+        | outcode(v2, scale_x, scale_y))
+        clip_triangle(state, v0, v1, v2);
+    else
+        emit_triangle(state, v0, v1, v2);
+}
+
+// This function clips a triangle (defined by the three vertices in the "in" array).
+// The triangle is clipped as a polygon against each of the clipping faces
+// face, face+1, ..., 5 that it crosses in turn (Sutherland-Hodgman), and the
+// resulting convex polygon is then split into a fan of triangles that are
+// passed on to rasterize_triangle.
+void clip_triangle(driver_state& state, const data_geometry& v0,
+    const data_geometry& v1, const data_geometry& v2,int face)
+{
+    // The left, right, bottom and top faces are those of the guard band
+    float scale_x, scale_y;
+    guard_band_scale(state, scale_x, scale_y);
+
+    // Only the faces that some vertex lies outside of need clipping against
+    int active = (outcode(v0, scale_x, scale_y) | outcode(v1, scale_x, scale_y)
+        | outcode(v2, scale_x, scale_y)) & (0x3f << face);
+
+    // Clipping a convex polygon against a plane adds at most one vertex and
+    // creates at most two new ones.  The polygon is kept as two ping-pong
+    // arrays of pointers to its vertices, which are either the original
+    // vertices or ones created in the fixed pool below.
+    const int max_vertices = 3 + 6;
+    const int max_created = 2 * 6;
+    const data_geometry* polygon[2][max_vertices] = {{&v0, &v1, &v2}};
+    int count = 3;
+    int current = 0;
+    data_geometry created[max_created];
+    float created_data[max_created][MAX_FLOATS_PER_VERTEX];
+    int num_created = 0;
+
+    // Clipping planes: 0=x=-sw, 1=x=sw, 2=y=-sw, 3=y=sw, 4=z=-w (near), 5=z=w (far)
+    // where s is the guard band scale.  A vertex is inside the plane if
+    // sign*comp <= scale*w.
+    auto distance = [](const data_geometry& v, int comp, float sign, float scale) -> float {
+        return scale * v.gl_Position[3] - sign * v.gl_Position[comp];
+    };
+
+    // Create the vertex where the edge from v_in (inside) to v_out (outside)
+    // crosses the plane, given their distances from it.
+    auto intersect = [&](const data_geometry& v_in, const data_geometry& v_out,
+                         float d_in, float d_out) -> const data_geometry* {
+        float t = d_in / (d_in - d_out);
+        t = std::max(0.0f, std::min(1.0f, t));
+
+        data_geometry& v = created[num_created];
+        v.data = created_data[num_created];
+        num_created++;
 
         for (int i = 0; i < 4; i++) {
             v.gl_Position[i] = v_in.gl_Position[i] + t * (v_out.gl_Position[i] - v_in.gl_Position[i]);
@@ -301,7 +659,9 @@ void clip_triangle(driver_state& state, const data_geometry& v0,
         for (int k = 0; k < state.floats_per_vertex; k++) {
             switch (state.interp_rules[k]) {
                 case interp_type::flat:
-                    v.data[k] = v_in.data[k];
+                    // Every triangle of the fan must see the flat data of
+                    // the original triangle's first vertex
+                    v.data[k] = v0.data[k];
                     break;
                 case interp_type::smooth:
                     v.data[k] = v_in.data[k] + t * (v_out.data[k] - v_in.data[k]);
@@ -345,93 +705,48 @@ void clip_triangle(driver_state& state, const data_geometry& v0,
             }
         }
 
-        return v;
+        return &v;
     };
 
-    // Helper function to create intersection point
-    auto intersect = [&](const data_geometry& v_in, const data_geometry& v_out) -> data_geometry {
-        // Calculate t where the edge intersects the clipping plane
-        // For plane: comp_val = clip_val * w
-        // Line: comp(t) = comp_in + t*(comp_out - comp_in), w(t) = w_in + t*(w_out - w_in)
-        // Intersection: comp_in + t*(comp_out - comp_in) = clip_val * (w_in + t*(w_out - w_in))
-        
-        float comp_in = v_in.gl_Position[comp];
-        float w_in = v_in.gl_Position[3];
-        float comp_out = v_out.gl_Position[comp];
-        float w_out = v_out.gl_Position[3];
-        
-        float clip_multiplier = (face % 2 == 0) ? -1.0f : 1.0f; // -1 for even faces (left/bottom/near), +1 for odd (right/top/far)
-        
-        // Solve: comp_in + t*(comp_out - comp_in) = clip_multiplier * (w_in + t*(w_out - w_in))
-        // comp_in + t*(comp_out - comp_in) = clip_multiplier * w_in + clip_multiplier * t * (w_out - w_in)
-        // comp_in - clip_multiplier * w_in = t * (clip_multiplier * (w_out - w_in) - (comp_out - comp_in))
-        
-        float num = comp_in - clip_multiplier * w_in;
-        float denom = clip_multiplier * (w_out - w_in) - (comp_out - comp_in);
-        
-        float t = (std::abs(denom) > 1e-6f) ? num / denom : 0.5f;
-        t = std::max(0.0f, std::min(1.0f, t));
-        
-        return interpolate_vertex(v_in, v_out, t);
-    };
-    
-    // One vertex inside
-    if(inside_count == 1) {
-        const data_geometry* v_in;
-        const data_geometry* v_out1;
-        const data_geometry* v_out2;
-        
-        if(in0) {
-            v_in = &v0;
-            v_out1 = &v1;
-            v_out2 = &v2;
-        } else if(in1) {
-            v_in = &v1;
-            v_out1 = &v0;
-            v_out2 = &v2;
-        } else {
-            v_in = &v2;
-            v_out1 = &v0;
-            v_out2 = &v1;
+    for (int f = face; f < 6 && active; f++) {
+        if (!(active & (1 << f))) continue;
+        int comp = f / 2;
+        float sign = (f % 2 == 0) ? -1.0f : 1.0f;
+        float scale = (f < 2) ? scale_x : ((f < 4) ? scale_y : 1.0f);
+
+        // Walk the edges of the polygon, keeping the inside vertices and
+        // adding a vertex wherever an edge crosses the plane.  Intersections
+        // are always computed from the inside vertex, so that an edge shared
+        // with a neighboring triangle is split at the same point.
+        const data_geometry* const* in = polygon[current];
+        const data_geometry** out = polygon[1 - current];
+        int out_count = 0;
+        const data_geometry* prev = in[count - 1];
+        float d_prev = distance(*prev, comp, sign, scale);
+        for (int i = 0; i < count; i++) {
+            const data_geometry* cur = in[i];
+            float d_cur = distance(*cur, comp, sign, scale);
+            if (d_cur >= 0) {
+                if (d_prev < 0) out[out_count++] = intersect(*cur, *prev, d_cur, d_prev);
+                out[out_count++] = cur;
+            } else if (d_prev >= 0) {
+                out[out_count++] = intersect(*prev, *cur, d_prev, d_cur);
+            }
+            prev = cur;
+            d_prev = d_cur;
         }
-        
-        data_geometry new1 = intersect(*v_in, *v_out1);
-        data_geometry new2 = intersect(*v_in, *v_out2);
-        
-        clip_triangle(state, *v_in, new1, new2, face + 1);
-        
-        delete[] new1.data;
-        delete[] new2.data;
-        return;
+
+        current = 1 - current;
+        count = out_count;
+        if (count < 3) return;
     }
-    
-    // Two vertices inside
-    const data_geometry* v_in1;
-    const data_geometry* v_in2;
-    const data_geometry* v_out;
-    
-    if(!in0) {
-        v_out = &v0;
-        v_in1 = &v1;
-        v_in2 = &v2;
-    } else if(!in1) {
-        v_out = &v1;
-        v_in1 = &v0;
-        v_in2 = &v2;
-    } else {
-        v_out = &v2;
-        v_in1 = &v0;
-        v_in2 = &v1;
+
+    // Split the clipped polygon into a fan of triangles around its first vertex
+    const data_geometry* const* p = polygon[current];
+    for (int i = 1; i + 1 < count; i++) {
+        if (!facing_rejected(state, *p[0], *p[i], *p[i + 1]))
+            emit_triangle(state, *p[0], *p[i], *p[i + 1]);
     }
-    
-    data_geometry new1 = intersect(*v_in1, *v_out);
-    data_geometry new2 = intersect(*v_in2, *v_out);
-    
-    clip_triangle(state, *v_in1, *v_in2, new1, face + 1);
-    clip_triangle(state, *v_in2, new1, new2, face + 1);
-    
-    delete[] new1.data;
-    delete[] new2.data;
 }
 
 // Rasterize the triangle defined by the three vertices in the "in" array.  This
@@ -439,157 +754,655 @@ void clip_triangle(driver_state& state, const data_geometry& v0,
 // fragments, calling the fragment shader, and z-buffering.
 void rasterize_triangle(driver_state& state, const data_geometry& v0,
     const data_geometry& v1, const data_geometry& v2)
+{
+    rasterize_triangle_region(state, v0, v1, v2,
+        0, state.image_width - 1, 0, state.image_height - 1, -1);
+}
+
+// Pixels are shaded in horizontal spans of up to SPAN_SIZE pixels, one row
+// of a block at a time.  Coverage, depth testing, interpolation and packing
+// of the output colors are done for all of the pixels of a span together,
+// using AVX2 when the processor supports it.  Only the fragment shader itself
+// is called one pixel at a time.  A span never leaves its block, so its
+// pixels are consecutive in the framebuffer (see pixel_index).
+static const int SPAN_SIZE = BLOCK_SIZE;
+
+struct triangle_setup;
+
+// Interpolate the smooth and noperspective attributes of a triangle to the
+// pixels of a span, given their barycentric coordinates bary and their
+// perspective-correct barycentric coordinates persp with respect to v[1] and
+// v[2].  attributes[k][i] receives the value of attribute k in lane i.
+typedef void (*interpolate_span_f)(const triangle_setup& t, const float bary[3][SPAN_SIZE],
+    const float persp[2][SPAN_SIZE], float attributes[][SPAN_SIZE]);
+
+// The values needed to shade spans of one triangle.
+struct triangle_setup
+{
+    const data_geometry* v[3];
+    float z[3];
+    float inv_w[3];
+    float area;
+    long long step_x[3];
+    long long bias[3];
+
+    // lane_offset[k][i] = i * step_x[k]
+    long long lane_offset[3][SPAN_SIZE];
+
+    // With multisampling, the change in edge function k from the center of a
+    // pixel to its sample s
+    long long sample_offset[3][MSAA_SAMPLES];
+
+    // For deferred shading, the index of the triangle in deferred_triangles,
+    // or -1 if the triangle is to be shaded right away, and whether v[1] and
+    // v[2] are swapped relative to the order in which it was stored there.
+    int deferred_id;
+    bool swapped;
+
+    // For each interpolated attribute k, the value at v[0] and its changes to
+    // v[1] and v[2].  Given barycentric coordinates b, it is then
+    // plane[k][0] + b[1] * plane[k][1] + b[2] * plane[k][2].
+    const interpolation_plan* plan;
+    interpolate_span_f interpolate;
+    float plane[MAX_FLOATS_PER_VERTEX][3];
+};
+
+// The interpolation kernel, specialized on the number of smooth (NS) and
+// noperspective (NN) attributes so that its loops are fully unrolled.  -1
+// means the number is taken from the plan instead.
+template<int NS, int NN>
+static void interpolate_span(const triangle_setup& t, const float bary[3][SPAN_SIZE],
+    const float persp[2][SPAN_SIZE], float attributes[][SPAN_SIZE])
+{
+    const interpolation_plan& plan = *t.plan;
+    int num_smooth = NS < 0 ? plan.num_smooth : NS;
+    int num_noperspective = NN < 0 ? plan.num_noperspective : NN;
+    for (int j = 0; j < num_smooth; j++) {
+        int k = plan.smooth[j];
+        const float* p = t.plane[k];
+        for (int i = 0; i < SPAN_SIZE; i++)
+            attributes[k][i] = p[0] + persp[0][i] * p[1] + persp[1][i] * p[2];
+    }
+    for (int j = 0; j < num_noperspective; j++) {
+        int k = plan.noperspective[j];
+        const float* p = t.plane[k];
+        for (int i = 0; i < SPAN_SIZE; i++)
+            attributes[k][i] = p[0] + bary[1][i] * p[1] + bary[2][i] * p[2];
+    }
+}
+
+// Kernels are specialized for up to this many attributes of each kind.
+static const int MAX_SPECIALIZED_ATTRIBUTES = 6;
+
+template<int NS>
+static interpolate_span_f select_interpolate_span(int num_noperspective)
+{
+    switch (num_noperspective) {
+    case 0: return interpolate_span<NS, 0>;
+    case 1: return interpolate_span<NS, 1>;
+    case 2: return interpolate_span<NS, 2>;
+    case 3: return interpolate_span<NS, 3>;
+    case 4: return interpolate_span<NS, 4>;
+    case 5: return interpolate_span<NS, 5>;
+    case 6: return interpolate_span<NS, 6>;
+    default: return interpolate_span<NS, -1>;
+    }
+}
+
+// The interpolation kernel for a render's attributes
+static interpolate_span_f select_interpolate_span(const interpolation_plan& plan)
+{
+    static_assert(MAX_SPECIALIZED_ATTRIBUTES == 6, "update the cases below");
+    int nn = plan.num_noperspective;
+    switch (plan.num_smooth) {
+    case 0: return select_interpolate_span<0>(nn);
+    case 1: return select_interpolate_span<1>(nn);
+    case 2: return select_interpolate_span<2>(nn);
+    case 3: return select_interpolate_span<3>(nn);
+    case 4: return select_interpolate_span<4>(nn);
+    case 5: return select_interpolate_span<5>(nn);
+    case 6: return select_interpolate_span<6>(nn);
+    default: return select_interpolate_span<-1>(nn);
+    }
+}
+
+// Record the triangle as visible in lanes mask of a span, with barycentric
+// coordinates bary, for deferred shading.
+static void record_visible(driver_state& state, const triangle_setup& t,
+    int x, int y, int mask, const float bary[3][SPAN_SIZE])
+{
+    int index = pixel_index(state, x, y);
+    for (int i = 0; i < SPAN_SIZE; i++) {
+        if (!(mask & (1 << i))) continue;
+        state.visible_triangle[index + i] = 2 * t.deferred_id + t.swapped;
+        for (int k = 0; k < 3; k++)
+            state.visible_bary[3 * (index + i) + k] = bary[k][i];
+    }
+}
+
+// Shade the covered fragments in lanes mask of a span, storing the resulting
+// colors in color.  attributes[k][i] is the value of interpolated attribute k
+// in lane i.  Flat attributes are the same for every fragment, so they are
+// filled in once.
+static void run_fragment_shader(const driver_state& state, const triangle_setup& t,
+    int mask, const float attributes[][SPAN_SIZE], float color[3][SPAN_SIZE])
+{
+    const interpolation_plan& plan = *t.plan;
+    float data[MAX_FLOATS_PER_VERTEX];
+    data_fragment frag_data{ data };
+    data_output output_data;
+    for (int j = 0; j < plan.num_flat; j++)
+        data[plan.flat[j]] = t.v[0]->data[plan.flat[j]];
+    for (int i = 0; i < SPAN_SIZE; i++) {
+        if (!(mask & (1 << i))) continue;
+        for (int j = 0; j < plan.num_smooth; j++)
+            data[plan.smooth[j]] = attributes[plan.smooth[j]][i];
+        for (int j = 0; j < plan.num_noperspective; j++)
+            data[plan.noperspective[j]] = attributes[plan.noperspective[j]][i];
+        state.fragment_shader(frag_data, output_data, state.uniform_data);
+        for (int c = 0; c < 3; c++)
+            color[c][i] = output_data.output_color[c];
+    }
+}
+
+// Interpolate the attributes of a triangle to the pixels of a span whose
+// barycentric coordinates are bary.
+static void interpolate_attributes(const triangle_setup& t, const float bary[3][SPAN_SIZE],
+    float attributes[][SPAN_SIZE])
+{
+    // Perspective-correct barycentric coordinates for v[1] and v[2]:
+    // G = alpha/w0 + beta/w1 + gamma/w2, corrected beta = beta/(G*w1), ...
+    float persp[2][SPAN_SIZE];
+    if (t.plan->num_smooth) {
+        for (int i = 0; i < SPAN_SIZE; i++) {
+            float G = bary[0][i] * t.inv_w[0] + bary[1][i] * t.inv_w[1] + bary[2][i] * t.inv_w[2];
+            float inv_G = 1.0f / G;
+            for (int k = 1; k < 3; k++)
+                persp[k - 1][i] = bary[k][i] * t.inv_w[k] * inv_G;
+        }
+    }
+    t.interpolate(t, bary, persp, attributes);
+}
+
+// Shade the n pixels starting at (x,y), where the edge functions are e.  If
+// partial is false, the span is known to lie inside the triangle.  Returns
+// whether any pixel passed the depth test.
+//
+// The barycentric coordinates of the pixels are found by stepping from the
+// first one.  The vectorized version below must compute everything with the
+// same operations in the same order, so that the two give identical images.
+static bool shade_span_scalar(driver_state& state, const triangle_setup& t,
+    int x, int y, int n, const long long e[3], bool partial)
+{
+    int mask = (1 << n) - 1;
+    if (partial)
+        for (int i = 0; i < n; i++)
+            for (int k = 0; k < 3; k++)
+                if (e[k] + t.bias[k] + t.lane_offset[k][i] < 0)
+                    mask &= ~(1 << i);
+    if (!mask) return false;
+
+    float bary[3][SPAN_SIZE];
+    float depth[SPAN_SIZE];
+    float* depth_row = state.image_depth + pixel_index(state, x, y);
+    for (int k = 0; k < 3; k++) {
+        float base = (float)e[k] / t.area;
+        float step = (float)t.step_x[k] / t.area;
+        for (int i = 0; i < SPAN_SIZE; i++)
+            bary[k][i] = base + (float)i * step;
+    }
+    for (int i = 0; i < n; i++) {
+        depth[i] = bary[0][i] * t.z[0] + bary[1][i] * t.z[1] + bary[2][i] * t.z[2];
+        if ((mask & (1 << i)) && depth[i] < depth_row[i])
+            depth_row[i] = depth[i];
+        else
+            mask &= ~(1 << i);
+    }
+    if (!mask) return false;
+    if (t.deferred_id >= 0) {
+        record_visible(state, t, x, y, mask, bary);
+        return true;
+    }
+
+    pixel* color_row = state.image_color + pixel_index(state, x, y);
+    if (state.fragment_info.constant) {
+        for (int i = 0; i < n; i++)
+            if (mask & (1 << i)) color_row[i] = state.constant_color;
+        return true;
+    }
+
+    float attributes[MAX_FLOATS_PER_VERTEX][SPAN_SIZE];
+    interpolate_attributes(t, bary, attributes);
+
+    float color[3][SPAN_SIZE];
+    run_fragment_shader(state, t, mask, attributes, color);
+
+    // Convert color from [0,1] to [0,255] and write to image
+    for (int i = 0; i < n; i++) {
+        if (!(mask & (1 << i))) continue;
+        int rgb[3];
+        for (int c = 0; c < 3; c++)
+            rgb[c] = std::max(0, std::min(255, (int)(color[c][i] * 255.0f)));
+        color_row[i] = make_pixel(rgb[0], rgb[1], rgb[2]);
+    }
+    return true;
+}
+
+#ifdef DRIVER_USE_AVX2
+__attribute__((target("avx2")))
+static bool shade_span_avx2(driver_state& state, const triangle_setup& t,
+    int x, int y, int n, const long long e[3], bool partial)
+{
+    int mask = (1 << n) - 1;
+    if (partial) {
+        // The sign bits of the biased edge functions mark uncovered lanes.
+        for (int k = 0; k < 3; k++) {
+            __m256i base = _mm256_set1_epi64x(e[k] + t.bias[k]);
+            __m256i lo = _mm256_add_epi64(base,
+                _mm256_loadu_si256((const __m256i*)&t.lane_offset[k][0]));
+            __m256i hi = _mm256_add_epi64(base,
+                _mm256_loadu_si256((const __m256i*)&t.lane_offset[k][4]));
+            int outside = _mm256_movemask_pd(_mm256_castsi256_pd(lo))
+                | (_mm256_movemask_pd(_mm256_castsi256_pd(hi)) << 4);
+            mask &= ~outside;
+        }
+        if (!mask) return false;
+    }
+
+    const __m256 lane = _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i lane_bit = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+    __m256 bary[3];
+    for (int k = 0; k < 3; k++) {
+        float base = (float)e[k] / t.area;
+        float step = (float)t.step_x[k] / t.area;
+        bary[k] = _mm256_add_ps(_mm256_set1_ps(base), _mm256_mul_ps(lane, _mm256_set1_ps(step)));
+    }
+
+    // Lanes past the end of the span are never loaded or stored, since they
+    // may lie outside the image.
+    float* depth_row = state.image_depth + pixel_index(state, x, y);
+    __m256i lanes = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(mask), lane_bit), lane_bit);
+    __m256 depth = _mm256_add_ps(_mm256_add_ps(
+        _mm256_mul_ps(bary[0], _mm256_set1_ps(t.z[0])),
+        _mm256_mul_ps(bary[1], _mm256_set1_ps(t.z[1]))),
+        _mm256_mul_ps(bary[2], _mm256_set1_ps(t.z[2])));
+    __m256 old_depth = _mm256_maskload_ps(depth_row, lanes);
+    mask &= _mm256_movemask_ps(_mm256_cmp_ps(depth, old_depth, _CMP_LT_OQ));
+    if (!mask) return false;
+    lanes = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(mask), lane_bit), lane_bit);
+    _mm256_maskstore_ps(depth_row, lanes, depth);
+    if (t.deferred_id >= 0) {
+        alignas(32) float stored_bary[3][SPAN_SIZE];
+        for (int k = 0; k < 3; k++)
+            _mm256_store_ps(stored_bary[k], bary[k]);
+        record_visible(state, t, x, y, mask, stored_bary);
+        return true;
+    }
+
+    int* color_row = (int*)(state.image_color + pixel_index(state, x, y));
+    if (state.fragment_info.constant) {
+        _mm256_maskstore_epi32(color_row, lanes, _mm256_set1_epi32(state.constant_color));
+        return true;
+    }
+
+    alignas(32) float stored_bary[3][SPAN_SIZE];
+    alignas(32) float persp[2][SPAN_SIZE];
+    for (int k = 0; k < 3; k++)
+        _mm256_store_ps(stored_bary[k], bary[k]);
+    if (t.plan->num_smooth) {
+        __m256 inv_w[3];
+        for (int k = 0; k < 3; k++)
+            inv_w[k] = _mm256_set1_ps(t.inv_w[k]);
+        __m256 G = _mm256_add_ps(_mm256_add_ps(
+            _mm256_mul_ps(bary[0], inv_w[0]), _mm256_mul_ps(bary[1], inv_w[1])),
+            _mm256_mul_ps(bary[2], inv_w[2]));
+        __m256 inv_G = _mm256_div_ps(_mm256_set1_ps(1.0f), G);
+        for (int k = 1; k < 3; k++)
+            _mm256_store_ps(persp[k - 1], _mm256_mul_ps(_mm256_mul_ps(bary[k], inv_w[k]), inv_G));
+    }
+
+    alignas(32) float attributes[MAX_FLOATS_PER_VERTEX][SPAN_SIZE];
+    t.interpolate(t, stored_bary, persp, attributes);
+
+    alignas(32) float color[3][SPAN_SIZE];
+    run_fragment_shader(state, t, mask, attributes, color);
+
+    // Convert color from [0,1] to [0,255], clamp, and pack into pixels
+    const __m256 scale = _mm256_set1_ps(255.0f);
+    const __m256i zero = _mm256_setzero_si256(), max_value = _mm256_set1_epi32(255);
+    __m256i packed = _mm256_set1_epi32(0xff);
+    for (int c = 0; c < 3; c++) {
+        __m256i value = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_load_ps(color[c]), scale));
+        value = _mm256_min_epi32(_mm256_max_epi32(value, zero), max_value);
+        packed = _mm256_or_si256(packed, _mm256_sllv_epi32(value, _mm256_set1_epi32(24 - 8 * c)));
+    }
+    _mm256_maskstore_epi32(color_row, lanes, packed);
+    return true;
+}
+#endif
+
+// Multisampling sample positions relative to the pixel center, in units of
+// 1/SUBPIXEL_SCALE of a pixel: the usual rotated grid, at multiples of 1/16 of
+// a pixel.  No sample is further than MSAA_SAMPLE_REACH from the center in x or
+// y.
+static const int MSAA_SAMPLE_POSITION[MSAA_SAMPLES][2] = {
+    {-2 * SUBPIXEL_SCALE / 16, -6 * SUBPIXEL_SCALE / 16},
+    { 6 * SUBPIXEL_SCALE / 16, -2 * SUBPIXEL_SCALE / 16},
+    {-6 * SUBPIXEL_SCALE / 16,  2 * SUBPIXEL_SCALE / 16},
+    { 2 * SUBPIXEL_SCALE / 16,  6 * SUBPIXEL_SCALE / 16}};
+static const int MSAA_SAMPLE_REACH = 6 * SUBPIXEL_SCALE / 16;
+
+// Write color c to the samples in sample_mask of pixel index.  When all of its
+// samples are written, the pixel goes back to keeping one color in
+// image_color and its slot is freed; otherwise it is expanded into a slot of
+// its block's sample pool.
+static void write_samples(driver_state& state, int index, int sample_mask, pixel c)
+{
+    sample_pool& pool = state.sample_pools[index / (BLOCK_SIZE * BLOCK_SIZE)];
+    int& slot = state.sample_slot[index];
+    if (sample_mask == (1 << MSAA_SAMPLES) - 1) {
+        state.image_color[index] = c;
+        if (slot >= 0) pool.free.push_back(slot);
+        slot = -1;
+        return;
+    }
+    if (slot < 0) {
+        if (!pool.free.empty()) {
+            slot = pool.free.back();
+            pool.free.pop_back();
+        } else {
+            slot = pool.colors.size() / MSAA_SAMPLES;
+            pool.colors.resize(pool.colors.size() + MSAA_SAMPLES);
+        }
+        std::fill(&pool.colors[MSAA_SAMPLES * slot], &pool.colors[MSAA_SAMPLES * slot] + MSAA_SAMPLES,
+            state.image_color[index]);
+    }
+    pixel* samples = &pool.colors[MSAA_SAMPLES * slot];
+    for (int s = 0; s < MSAA_SAMPLES; s++)
+        if (sample_mask & (1 << s)) samples[s] = c;
+}
+
+// Shade the n pixels starting at (x,y) with multisampling.  Coverage and
+// depth are tested separately at each sample of a pixel, and then the
+// fragment shader is run at the center of every pixel where any sample
+// passed.  See shade_span_scalar.
+static bool shade_span_msaa(driver_state& state, const triangle_setup& t,
+    int x, int y, int n, const long long e[3], bool partial)
+{
+    int index = pixel_index(state, x, y);
+    int mask = 0;
+    int sample_mask[SPAN_SIZE] = {};
+    for (int i = 0; i < n; i++) {
+        float* depth = &state.sample_depth[MSAA_SAMPLES * (index + i)];
+        for (int s = 0; s < MSAA_SAMPLES; s++) {
+            long long f[3];
+            bool covered = true;
+            for (int k = 0; k < 3; k++) {
+                f[k] = e[k] + t.lane_offset[k][i] + t.sample_offset[k][s];
+                if (partial && f[k] + t.bias[k] < 0) covered = false;
+            }
+            if (!covered) continue;
+            float z = (float)f[0] / t.area * t.z[0] + (float)f[1] / t.area * t.z[1]
+                + (float)f[2] / t.area * t.z[2];
+            if (z < depth[s]) {
+                depth[s] = z;
+                sample_mask[i] |= 1 << s;
+            }
+        }
+        if (sample_mask[i]) mask |= 1 << i;
+    }
+    if (!mask) return false;
+
+    if (state.fragment_info.constant) {
+        for (int i = 0; i < n; i++)
+            if (mask & (1 << i)) write_samples(state, index + i, sample_mask[i], state.constant_color);
+        return true;
+    }
+
+    float bary[3][SPAN_SIZE];
+    for (int k = 0; k < 3; k++) {
+        float base = (float)e[k] / t.area;
+        float step = (float)t.step_x[k] / t.area;
+        for (int i = 0; i < SPAN_SIZE; i++)
+            bary[k][i] = base + (float)i * step;
+    }
+    float attributes[MAX_FLOATS_PER_VERTEX][SPAN_SIZE];
+    interpolate_attributes(t, bary, attributes);
+
+    float color[3][SPAN_SIZE];
+    run_fragment_shader(state, t, mask, attributes, color);
+    for (int i = 0; i < n; i++) {
+        if (!(mask & (1 << i))) continue;
+        int rgb[3];
+        for (int c = 0; c < 3; c++)
+            rgb[c] = std::max(0, std::min(255, (int)(color[c][i] * 255.0f)));
+        write_samples(state, index + i, sample_mask[i], make_pixel(rgb[0], rgb[1], rgb[2]));
+    }
+    return true;
+}
+
+// The largest depth stored in the block whose lower left pixel is (bx,by)
+static float max_block_depth(const driver_state& state, int bx, int by)
+{
+    // The block is one tile of the framebuffer, but only the part of it
+    // within the image is ever drawn to.
+    int w = std::min(BLOCK_SIZE, state.image_width - bx);
+    int h = std::min(BLOCK_SIZE, state.image_height - by);
+    int base = pixel_index(state, bx, by);
+    float max_depth = -std::numeric_limits<float>::max();
+    for (int y = 0; y < h; y++) {
+        int row = base + y * BLOCK_SIZE;
+        if (state.msaa) {
+            const float* depth_row = &state.sample_depth[MSAA_SAMPLES * row];
+            for (int i = 0; i < MSAA_SAMPLES * w; i++)
+                max_depth = std::max(max_depth, depth_row[i]);
+            continue;
+        }
+        const float* depth_row = state.image_depth + row;
+        for (int x = 0; x < w; x++)
+            max_depth = std::max(max_depth, depth_row[x]);
+    }
+    return max_depth;
+}
+
+typedef bool (*shade_span_f)(driver_state& state, const triangle_setup& t,
+    int x, int y, int n, const long long e[3], bool partial);
+
+// Pick the span shader for the processor we are running on.
+static shade_span_f select_shade_span()
+{
+#ifdef DRIVER_USE_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return shade_span_avx2;
+#endif
+    return shade_span_scalar;
+}
+
+static const shade_span_f shade_span = select_shade_span();
+
+// Bound on the rounding error of the depths that the span shaders compute,
+// in units of FLT_EPSILON times the sum over the vertices of |z[k]| times the
+// largest magnitude of barycentric coordinate k over the block, or 1 if that
+// is larger.  A coordinate is found with about a dozen roundings of values no
+// larger than three times that magnitude (the conversion and division of the
+// edge function and the step, the step times the lane, and their sum), and
+// the depth adds three more roundings of the products.  Each rounding is off
+// by at most FLT_EPSILON/2 of its value, so 16 leaves a margin.
+static const double DEPTH_ROUNDING_BOUND = 16;
+
+static void rasterize_triangle_region(driver_state& state, const data_geometry& v0,
+    const data_geometry& v1, const data_geometry& v2,
+    int x_lo, int x_hi, int y_lo, int y_hi, int deferred_id)
 {
     // Convert NDC coordinates (-1 to 1) to screen pixel coordinates
     // NDC: x,y in [-1,1], z in [-1,1] (depth)
     // Screen: x,y in [0, image_width-1] x [0, image_height-1]
-    
-    float x0 = (v0.gl_Position[0] / v0.gl_Position[3] + 1.0f) * 0.5f * state.image_width;
-    float y0 = (v0.gl_Position[1] / v0.gl_Position[3] + 1.0f) * 0.5f * state.image_height;
-    float z0 = v0.gl_Position[2] / v0.gl_Position[3];
-    
-    float x1 = (v1.gl_Position[0] / v1.gl_Position[3] + 1.0f) * 0.5f * state.image_width;
-    float y1 = (v1.gl_Position[1] / v1.gl_Position[3] + 1.0f) * 0.5f * state.image_height;
-    float z1 = v1.gl_Position[2] / v1.gl_Position[3];
-    
-    float x2 = (v2.gl_Position[0] / v2.gl_Position[3] + 1.0f) * 0.5f * state.image_width;
-    float y2 = (v2.gl_Position[1] / v2.gl_Position[3] + 1.0f) * 0.5f * state.image_height;
-    float z2 = v2.gl_Position[2] / v2.gl_Position[3];
-    
-    // Calculate bounding box with proper rounding to include edge pixels
-    // Since we sample at pixel center (x + 0.5), we need to account for this offset
-    // Pixel at index x has center at x + 0.5
-    // To include all pixels that might be covered, we need to consider pixel centers
-    float min_xf = std::min({x0, x1, x2});
-    float max_xf = std::max({x0, x1, x2});
-    float min_yf = std::min({y0, y1, y2});
-    float max_yf = std::max({y0, y1, y2});
-    
-    // For min: floor(min - 0.5) gives the smallest pixel index whose center (x+0.5) might be >= min
-    // For max: floor(max - 0.5) + 1 gives the largest pixel index whose center might be <= max
-    int min_x = std::max(0, (int)std::floor(min_xf - 0.5f));
-    int max_x = std::min(state.image_width - 1, (int)std::floor(max_xf - 0.5f) + 1);
-    int min_y = std::max(0, (int)std::floor(min_yf - 0.5f));
-    int max_y = std::min(state.image_height - 1, (int)std::floor(max_yf - 0.5f) + 1);
-    
-    // Iterate over pixels in bounding box
-    for (int y = min_y; y <= max_y; y++) {
-        for (int x = min_x; x <= max_x; x++) {
-            // Sample at pixel center (x + 0.5, y + 0.5)
-            float px = x + 0.5f;
-            float py = y + 0.5f;
-            
-            // Calculate barycentric coordinates using cross product method
-            // For triangle v0, v1, v2 and point p:
-            // alpha = area(p, v1, v2) / area(v0, v1, v2)
-            // beta = area(v0, p, v2) / area(v0, v1, v2)
-            // gamma = area(v0, v1, p) / area(v0, v1, v2)
-            // Using 2D cross product: area = 0.5 * |(v1 - v0) × (v2 - v0)|
-            
-            // Calculate areas using cross product (2D cross product z-component)
-            // Cross product for vectors (x1,y1) and (x2,y2): x1*y2 - x2*y1
-            float denom = (y1 - y0) * (x2 - x0) - (x1 - x0) * (y2 - y0);
-            
-            // Check for degenerate triangle
-            if (std::abs(denom) < 1e-10f) {
-                continue;
+    // The screen positions are then snapped to fixed point with SUBPIXEL_BITS
+    // bits of sub-pixel precision, so that coverage is decided exactly.
+    const data_geometry* v[3] = {&v0, &v1, &v2};
+    float z[3];
+    long long X[3], Y[3];
+    for (int i = 0; i < 3; i++) {
+        float w = v[i]->gl_Position[3];
+        float x = (v[i]->gl_Position[0] / w + 1.0f) * 0.5f * state.image_width;
+        float y = (v[i]->gl_Position[1] / w + 1.0f) * 0.5f * state.image_height;
+        z[i] = v[i]->gl_Position[2] / w;
+        X[i] = std::llround(x * SUBPIXEL_SCALE);
+        Y[i] = std::llround(y * SUBPIXEL_SCALE);
+    }
+
+    // Twice the signed area, in fixed point.  Triangles are rasterized
+    // counterclockwise, so clockwise triangles have their last two vertices
+    // swapped.  The first vertex stays first, since flat interpolation uses it.
+    long long area = (X[1] - X[0]) * (Y[2] - Y[0]) - (Y[1] - Y[0]) * (X[2] - X[0]);
+    if (area == 0) return;
+    if (area < 0) {
+        std::swap(v[1], v[2]);
+        std::swap(z[1], z[2]);
+        std::swap(X[1], X[2]);
+        std::swap(Y[1], Y[2]);
+        area = -area;
+    }
+
+    // Edge k is opposite vertex k, running from vertex k+1 to vertex k+2.  Its
+    // edge function, evaluated at the center of pixel (x,y), is
+    // e[k].step_x * x + e[k].step_y * y + e[k].offset.  It is zero on the edge,
+    // equals area at vertex k, and divided by area gives the barycentric
+    // coordinate of vertex k.
+    //
+    // Pixel centers that lie exactly on an edge are covered only if it is a
+    // top or left edge, so that pixels on an edge shared by two triangles are
+    // drawn exactly once.  Going counterclockwise (with y up), left edges
+    // point down and top edges point left.  This is folded into the offset
+    // as a bias of -1 for other edges, so that coverage is simply e >= 0.
+    struct edge_function { long long step_x, step_y, offset, bias; } e[3];
+    for (int k = 0; k < 3; k++) {
+        int a = (k + 1) % 3, b = (k + 2) % 3;
+        long long dx = X[b] - X[a], dy = Y[b] - Y[a];
+        bool top_left = dy < 0 || (dy == 0 && dx < 0);
+        e[k].bias = top_left ? 0 : -1;
+        e[k].step_x = -dy * SUBPIXEL_SCALE;
+        e[k].step_y = dx * SUBPIXEL_SCALE;
+        e[k].offset = dx * (SUBPIXEL_SCALE / 2 - Y[a]) - dy * (SUBPIXEL_SCALE / 2 - X[a]);
+    }
+
+    // Only the pixels of the bounding box that lie within the region
+    int min_x, max_x, min_y, max_y;
+    pixel_bounds(state, v0, v1, v2, min_x, max_x, min_y, max_y);
+    min_x = std::max(min_x, x_lo);
+    max_x = std::min(max_x, x_hi);
+    min_y = std::max(min_y, y_lo);
+    max_y = std::min(max_y, y_hi);
+
+    triangle_setup t;
+    for (int k = 0; k < 3; k++) {
+        t.v[k] = v[k];
+        t.z[k] = z[k];
+        t.inv_w[k] = 1.0f / v[k]->gl_Position[3];
+        t.step_x[k] = e[k].step_x;
+        t.bias[k] = e[k].bias;
+        for (int i = 0; i < SPAN_SIZE; i++)
+            t.lane_offset[k][i] = i * e[k].step_x;
+        for (int s = 0; s < MSAA_SAMPLES; s++)
+            t.sample_offset[k][s] = e[k].step_x / SUBPIXEL_SCALE * MSAA_SAMPLE_POSITION[s][0]
+                + e[k].step_y / SUBPIXEL_SCALE * MSAA_SAMPLE_POSITION[s][1];
+    }
+    t.area = area;
+    t.deferred_id = deferred_id;
+    t.swapped = v[1] != &v1;
+
+    const interpolation_plan& plan = state.interpolation;
+    t.plan = &plan;
+    t.interpolate = select_interpolate_span(plan);
+    for (int j = 0; j < plan.num_smooth + plan.num_noperspective; j++) {
+        int k = j < plan.num_smooth ? plan.smooth[j] : plan.noperspective[j - plan.num_smooth];
+        float d0 = v[0]->data[k];
+        t.plane[k][0] = d0;
+        t.plane[k][1] = v[1]->data[k] - d0;
+        t.plane[k][2] = v[2]->data[k] - d0;
+    }
+
+    // Depth varies linearly over the screen, so the exact depth of the
+    // triangle within a block is at least the smallest of its depths at the
+    // block's corners, and at the pixels it covers at least the smallest depth
+    // of its vertices.  The depths that the pixels compute may come out below
+    // that by rounding, by at most DEPTH_ROUNDING_BOUND.
+    float min_z = std::min({z[0], z[1], z[2]});
+
+    // Walk the bounding box in blocks of BLOCK_SIZE x BLOCK_SIZE pixels,
+    // aligned to multiples of BLOCK_SIZE so that they never straddle a tile.
+    // Since the edge functions are linear, their extremes over a block occur
+    // at its corners.  A block entirely outside any edge is skipped, and the
+    // pixels of a block entirely inside every edge need no coverage test.
+    // Blocks where the triangle lies behind everything already drawn are
+    // skipped as well.
+    //
+    // With multisampling, the samples of a block reach up to
+    // MSAA_SAMPLE_REACH beyond its corner pixel centers, which widens the
+    // range of each edge function by margin[k].  The triangle's depth at the
+    // samples is then only bounded by its smallest vertex depth.
+    const int span = BLOCK_SIZE - 1;
+    shade_span_f shade = state.msaa ? shade_span_msaa : shade_span;
+    long long margin[3] = {};
+    if (state.msaa)
+        for (int k = 0; k < 3; k++)
+            margin[k] = (std::abs(e[k].step_x) + std::abs(e[k].step_y)) / SUBPIXEL_SCALE * MSAA_SAMPLE_REACH;
+    for (int by = min_y & ~span; by <= max_y; by += BLOCK_SIZE) {
+        for (int bx = min_x & ~span; bx <= max_x; bx += BLOCK_SIZE) {
+            long long corner[3];
+            bool outside = false;
+            bool partial = false;
+            for (int k = 0; k < 3; k++) {
+                corner[k] = e[k].step_x * bx + e[k].step_y * by + e[k].offset;
+                long long lo = corner[k] + e[k].bias - margin[k]
+                    + std::min(e[k].step_x, 0LL) * span + std::min(e[k].step_y, 0LL) * span;
+                long long hi = corner[k] + e[k].bias + margin[k]
+                    + std::max(e[k].step_x, 0LL) * span + std::max(e[k].step_y, 0LL) * span;
+                if (hi < 0) outside = true;
+                if (lo < 0) partial = true;
             }
-            
-            // Calculate barycentric coordinates using pixel center
-            // Standard formula: 
-            // alpha = area(p, v1, v2) / area(v0, v1, v2) = area_p_v1_v2 / denom
-            // beta = area(v0, p, v2) / area(v0, v1, v2) = area_v0_p_v2 / denom  
-            // gamma = area(v0, v1, p) / area(v0, v1, v2) = area_v0_v1_p / denom
-            // where denom = area(v0, v1, v2)
-            float area_p_v1_v2 = (y1 - py) * (x2 - px) - (x1 - px) * (y2 - py);
-            float area_v0_p_v2 = (py - y0) * (x2 - x0) - (px - x0) * (y2 - y0);
-            float area_v0_v1_p = (y1 - y0) * (px - x0) - (x1 - x0) * (py - y0);
-            
-            // Calculate barycentric coordinates
-            // Note: All areas have the same sign as denom, so division preserves correct signs
-            float alpha = area_p_v1_v2 / denom;
-            float beta = area_v0_p_v2 / denom;
-            float gamma = area_v0_v1_p / denom;
-            
-            // Verify they sum to 1 (should always be true for barycentric coords)
-            // alpha + beta + gamma should equal 1, but due to floating point errors, we recalculate
-            // Actually, let's keep the direct calculation and just verify
-            
-            // Check if point is inside triangle (use small epsilon for edge cases)
-            // For points inside triangle, all barycentric coordinates should be >= 0
-            // We use epsilon to handle edge cases and numerical errors
-            const float epsilon = 1e-6f;
-            if (alpha >= -epsilon && beta >= -epsilon && gamma >= -epsilon) {
-                // Calculate depth using barycentric coordinates
-                float depth = alpha * z0 + beta * z1 + gamma * z2;
-                
-                // Depth test
-                int pixel_index = y * state.image_width + x;
-                if (depth < state.image_depth[pixel_index]) {
-                    // Update depth buffer
-                    state.image_depth[pixel_index] = depth;
-
-                    // Interpolate vertex data
-                    auto* data = new float[state.floats_per_vertex];
-                    data_fragment frag_data{ data };
-                    data_output output_data;
-                    
-                    for (int k = 0; k < state.floats_per_vertex; k++) {
-                        switch (state.interp_rules[k]) {
-                        case interp_type::flat:
-                            // Use vertex data from first vertex
-                            data[k] = v0.data[k];
-                            break;
-                        case interp_type::smooth:
-                            // Use perspective-correct interpolation using PPT formula
-                            // G = (alpha/v0[3] + beta/v1[3] + gamma/v2[3])
-                            // Alpha = alpha / (G*v0[3])
-                            // Beta = beta / (G*v1[3])
-                            // Gamma = gamma / (G*v2[3])
-                            {
-                                float w0 = v0.gl_Position[3];
-                                float w1 = v1.gl_Position[3];
-                                float w2 = v2.gl_Position[3];
-                                
-                                float G = alpha / w0 + beta / w1 + gamma / w2;
-                                float alpha_corrected = alpha / (G * w0);
-                                float beta_corrected = beta / (G * w1);
-                                float gamma_corrected = gamma / (G * w2);
-                                
-                                data[k] = alpha_corrected * v0.data[k] + 
-                                         beta_corrected * v1.data[k] + 
-                                         gamma_corrected * v2.data[k];
-                            }
-                            break;
-                        case interp_type::noperspective:
-                            // Use regular barycentric coordinates for linear interpolation
-                            data[k] = alpha * v0.data[k] + beta * v1.data[k] + gamma * v2.data[k];
-                            break;
-                        default:
-                            break;
-                        }
-                    }
+            if (outside) continue;
 
-                    // Call fragment shader
-                    state.fragment_shader(frag_data, output_data, state.uniform_data);
-
-                    // Convert color from [0,1] to [0,255] and write to image
-                    int r = (int)(output_data.output_color[0] * 255.0f);
-                    int g = (int)(output_data.output_color[1] * 255.0f);
-                    int b = (int)(output_data.output_color[2] * 255.0f);
-                    
-                    // Clamp values to valid range
-                    r = std::max(0, std::min(255, r));
-                    g = std::max(0, std::min(255, g));
-                    b = std::max(0, std::min(255, b));
-                    
-                    state.image_color[pixel_index] = make_pixel(r, g, b);
-                    
-                    // Clean up interpolated data
-                    delete[] data;
+            int block = (by / BLOCK_SIZE) * state.blocks_x + bx / BLOCK_SIZE;
+            float* block_max = &state.block_max_depth[block];
+            // The samples of a multisampled pixel compute their depths
+            // directly from barycentric coordinates within [0,1].
+            double block_min_z = min_z;
+            double magnitude[3] = {1, 1, 1};
+            if (!state.msaa) {
+                double corner_min_z = std::numeric_limits<double>::max();
+                for (int c = 0; c < 4; c++) {
+                    double depth = 0;
+                    for (int k = 0; k < 3; k++) {
+                        double b = (double)(corner[k] + (c & 1) * e[k].step_x * span
+                            + (c >> 1) * e[k].step_y * span) / area;
+                        magnitude[k] = std::max(magnitude[k], std::fabs(b));
+                        depth += b * z[k];
+                    }
+                    corner_min_z = std::min(corner_min_z, depth);
                 }
+                block_min_z = std::max(block_min_z, corner_min_z);
             }
+            double rounding = 0;
+            for (int k = 0; k < 3; k++)
+                rounding += magnitude[k] * std::fabs(z[k]);
+            block_min_z -= DEPTH_ROUNDING_BOUND * FLT_EPSILON * rounding;
+            if (block_min_z > *block_max) continue;
+            prepare_block(state, block);
+
+            int x0 = std::max(bx, min_x), x1 = std::min(bx + span, max_x);
+            int y0 = std::max(by, min_y), y1 = std::min(by + span, max_y);
+            long long row[3];
+            for (int k = 0; k < 3; k++)
+                row[k] = corner[k] + e[k].step_x * (x0 - bx) + e[k].step_y * (y0 - by);
+
+            bool written = false;
+            for (int y = y0; y <= y1; y++) {
+                written |= shade(state, t, x0, y, x1 - x0 + 1, row, partial);
+                for (int k = 0; k < 3; k++) row[k] += e[k].step_y;
+            }
+            if (written) *block_max = max_block_depth(state, bx, by);
         }
     }
 }
-
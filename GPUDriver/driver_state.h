@@ -2,6 +2,70 @@
 #define __DRIVER__
 
 #include "common.h"
+#include <utility>
+#include <vector>
+
+class thread_pool;
+
+// The screen is divided into square tiles of this many pixels on a side for
+// multithreaded rasterization.
+static const int TILE_SIZE = 64;
+
+// Triangles are rasterized in blocks of BLOCK_SIZE x BLOCK_SIZE pixels, which
+// must divide TILE_SIZE.  Vertex positions are snapped to 1/SUBPIXEL_SCALE of
+// a pixel.
+static const int BLOCK_SIZE = 8;
+static const int SUBPIXEL_BITS = 8;
+static const int SUBPIXEL_SCALE = 1 << SUBPIXEL_BITS;
+
+// Triangles are only clipped against the left, right, bottom and top faces of
+// the view volume if they extend more than GUARD_BAND pixels beyond the edge
+// of the screen.  Within this guard band the rasterizer simply skips the
+// pixels that are off screen.  It is small enough that fixed-point edge
+// functions cannot overflow.
+static const int GUARD_BAND = 4096;
+
+// Number of coverage and depth samples per pixel with multisampling.
+static const int MSAA_SAMPLES = 4;
+
+// The attributes of a render grouped by how they are interpolated, built by
+// render from interp_rules.  flat lists the num_flat attributes that use
+// flat interpolation (or an invalid interp_type), and similarly for smooth
+// and noperspective.
+struct interpolation_plan
+{
+    int num_flat = 0;
+    int num_smooth = 0;
+    int num_noperspective = 0;
+    int flat[MAX_FLOATS_PER_VERTEX];
+    int smooth[MAX_FLOATS_PER_VERTEX];
+    int noperspective[MAX_FLOATS_PER_VERTEX];
+};
+
+// The state of one render that is needed to shade its pixels later, in
+// deferred shading mode.
+struct deferred_draw
+{
+    void (*fragment_shader)(const data_fragment& in, data_output& out,
+        const float * uniform_data);
+    std::vector<float> uniform_data;
+    int floats_per_vertex;
+    interpolation_plan interpolation;
+
+    // Whether the fragment shader is constant, and if so its output
+    bool constant;
+    pixel constant_color;
+};
+
+// The sample colors of the expanded pixels of one block, with multisampling.
+// A pixel whose slot in sample_slot is s keeps its MSAA_SAMPLES colors at
+// MSAA_SAMPLES * s in colors.  free lists the slots that are no longer in use.
+// Each block belongs to a single tile, so only one thread touches its pool.
+struct sample_pool
+{
+    std::vector<pixel> colors;
+    std::vector<int> free;
+};
 
 struct driver_state
 {
@@ -25,10 +89,10 @@ struct driver_state
 
     // This is data that is constant over all triangles and fragments.
     // It is accessible from all of the shaders.  The user can store things
-    // like transforms here.  The size of this array is not stored
-    // since the driver will never need to know its size; you will just need
-    // to supply the pointer when necessary.
+    // like transforms here.  There are num_uniforms floats in the array; the
+    // driver only needs to know this to keep a copy for deferred shading.
     float * uniform_data = 0;
+    int num_uniforms = 0;
 
     // Vertex data (such as color) at the vertices of triangles must be
     // interpolated to each pixel (fragment) within the triangle before calling
@@ -44,26 +108,50 @@ struct driver_state
     //                                 barycentric coordinates.
     interp_type interp_rules[MAX_FLOATS_PER_VERTEX] = {};
 
+    // interp_rules for the current render, grouped by interpolation type
+    interpolation_plan interpolation;
+
     // Image dimensions
     int image_width = 0;
     int image_height = 0;
 
-    // Buffer where color data is stored.  The first image_width entries
-    // correspond to the bottom row of the image, the next image_width entries
-    // correspond to the next row, etc.  The array has image_width*image_height
-    // entries.
+    // Buffer where color data is stored.  Pixel (x,y), with y=0 being the
+    // bottom row, is stored at pixel_index(state,x,y).  The image is stored in
+    // tiles and padded to a whole number of them, so the array has
+    // framebuffer_size entries.  read_image returns the image in row-major
+    // order.
     pixel * image_color = 0;
+    int framebuffer_size = 0;
 
     // This array stores the depth of a pixel and is used for z-buffering.  The
     // size and layout is the same as image_color.
     float * image_depth = 0;
 
+    // Hierarchical z-buffer: the largest depth stored in each BLOCK_SIZE x
+    // BLOCK_SIZE block of image_depth, with blocks_x blocks per row.  These
+    // blocks are also the tiles of the framebuffer layout.  Blocks
+    // that a triangle lies entirely behind are skipped without rasterizing
+    // them.
+    std::vector<float> block_max_depth;
+    int blocks_x = 0;
+
+    // Fast clear: one flag per block, set when the block has been cleared
+    // but not drawn to since.  Its pixels are then black at the maximum
+    // depth, whatever the buffers hold; they are only reset when the block
+    // is first drawn to, and readers of the buffers check the flag.
+    std::vector<char> block_cleared;
+
     // Pointer to a function, which performs the role of a vertex shader.  It
     // should be called on each vertex and given data stored in vertex_data.
     // This routine also receives the uniform data.
     void (*vertex_shader)(const data_vertex& in, data_geometry& out,
         const float * uniform_data);
 
+    // Optional batched version of vertex_shader.  If set, it is called
+    // instead of vertex_shader, on VERTEX_BATCH_SIZE vertices at a time.
+    void (*vertex_shader_batch)(const data_vertex_batch& in, data_geometry_batch& out,
+        const float * uniform_data) = 0;
+
     // Pointer to a function, which performs the role of a fragment shader.  It
     // should be called for each pixel (fragment) within each triangle.  The
     // fragment shader should be given interpolated vertex data (interpolated
@@ -71,10 +159,122 @@ struct driver_state
     void (*fragment_shader)(const data_fragment& in, data_output& out,
         const float * uniform_data);
 
+    // What fragment_shader reads and whether its output is constant; see
+    // fragment_shader_info.  For a constant shader, render evaluates it once
+    // and stores the result in constant_color, which covered pixels are
+    // simply filled with.
+    fragment_shader_info fragment_info = {~0ull, false};
+    pixel constant_color = 0;
+
+    // Whether triangles that face away from the viewer are discarded.  Front
+    // faces are those whose vertices appear counterclockwise on the screen.
+    bool cull_back_faces = false;
+
+    // Set by render while it assembles a triangle whose vertices are listed
+    // clockwise when it faces the viewer: every other triangle of a strip.
+    bool reversed_winding = false;
+
+    // Number of threads used for rasterization.  With one thread, triangles
+    // are rasterized as soon as they have been clipped.  With more, render
+    // first runs the geometry stage (vertex shading and clipping) for the
+    // whole draw and sorts the resulting triangles into bins, one per tile of
+    // the screen.  The tiles are then rasterized in parallel, each processing
+    // its triangles in the order they were submitted, so the image is the same
+    // as with one thread.
+    int num_threads = 1;
+    thread_pool* threads = 0;
+
+    // Set while render is binning triangles rather than rasterizing them.
+    bool binning = false;
+
+    // Triangles binned during the current render.  Each triangle stores its
+    // three vertices consecutively in binned_vertices, each vertex being
+    // gl_Position followed by floats_per_vertex floats of data.  bins has one
+    // entry per tile listing the triangles (indices into the triangles stored
+    // in binned_vertices) that overlap it, in submission order.
+    std::vector<float> binned_vertices;
+    std::vector<std::vector<int> > bins;
+    int tiles_x = 0;
+    int tiles_y = 0;
+
+    // Post-transform vertex cache, so that a vertex shared by several
+    // triangles is only shaded once per render.  Before assembling triangles,
+    // render shades every vertex that is used (vertex_used[i]), storing the
+    // output for vertex i in shaded_vertices[i], whose data points into
+    // shaded_data.
+    std::vector<data_geometry> shaded_vertices;
+    std::vector<float> shaded_data;
+    std::vector<char> vertex_used;
+
+    // Deferred shading.  When set, rasterization only performs the depth test
+    // and records which triangle is visible at each pixel, along with its
+    // barycentric coordinates there.  The fragment shader is then run once
+    // per visible pixel by finish_render, after all renders, rather than
+    // every time a pixel is drawn over.
+    //
+    // Every render stores its shading state in deferred_draws.  Each triangle
+    // that reaches rasterization is stored in deferred_vertices, as w and
+    // then floats_per_vertex floats of data for each of its three vertices.
+    // deferred_triangles holds, for each triangle, the index of its render
+    // and the offset of its vertices in deferred_vertices.  For each pixel,
+    // visible_triangle is twice the index of the visible triangle, plus one
+    // if the rasterizer swapped its last two vertices (or -1 if there is
+    // none), and visible_bary its three barycentric coordinates in the
+    // rasterizer's vertex order.
+    bool deferred = false;
+    std::vector<deferred_draw> deferred_draws;
+    std::vector<float> deferred_vertices;
+    std::vector<std::pair<int,int> > deferred_triangles;
+    std::vector<int> visible_triangle;
+    std::vector<float> visible_bary;
+
+    // Triangle indices into deferred_triangles of the triangles in
+    // binned_vertices, when shading is deferred.
+    std::vector<int> binned_ids;
+
+    // Multisample antialiasing.  When set, coverage and depth are tested at
+    // MSAA_SAMPLES points in each pixel, but the fragment shader still runs
+    // once per pixel (at its center) for each triangle that covers any of
+    // them.  finish_render averages the samples into image_color.  This
+    // cannot be combined with deferred shading, and may only be changed
+    // before initialize_render, which allocates the sample buffers.
+    //
+    // Depth is stored per sample, sample s of pixel i being at
+    // MSAA_SAMPLES * i + s in sample_depth.  Colors are only stored per
+    // sample for the pixels whose samples differ, such as those on the edge
+    // of a triangle.  Such a pixel is expanded: sample_slot gives its slot in
+    // the sample_pools entry of its block, or is -1 if it is not expanded.
+    // Every other pixel keeps its one color in image_color, so memory for
+    // sample colors grows with the number of edge pixels, not of pixels.
+    bool msaa = false;
+    std::vector<float> sample_depth;
+    std::vector<int> sample_slot;
+    std::vector<sample_pool> sample_pools;
+
     driver_state();
     ~driver_state();
+
+    // The state owns its framebuffers and thread pool, so it cannot be
+    // copied.
+    driver_state(const driver_state&) = delete;
+    driver_state& operator=(const driver_state&) = delete;
 };
 
+// Index of pixel (x,y) in image_color, image_depth and the other per-pixel
+// buffers.  These are stored as BLOCK_SIZE x BLOCK_SIZE tiles, one row of
+// tiles after another, with the pixels of each tile in row-major order.  The
+// pixels of a block, which the rasterizer visits together, are then
+// contiguous rather than spread over BLOCK_SIZE rows of the image.
+inline int pixel_index(const driver_state& state, int x, int y)
+{
+    return ((y / BLOCK_SIZE) * state.blocks_x + x / BLOCK_SIZE) * (BLOCK_SIZE * BLOCK_SIZE)
+        + (y % BLOCK_SIZE) * BLOCK_SIZE + x % BLOCK_SIZE;
+}
+
+// Copy image_color into image, which has image_width*image_height entries, in
+// row-major order with the bottom row first.
+void read_image(const driver_state& state, pixel* image);
+
 // Set up the internal state of this class.  This is not done during the
 // constructor since the width and height are not known when this class is
 // constructed.
@@ -89,10 +289,25 @@ void initialize_render(driver_state& state, int width, int height);
 //   render_type::strip -    The vertices are to be interpreted as a triangle strip.
 void render(driver_state& state, render_type type);
 
-// This function clips a triangle (defined by the three vertices in the "in" array).
-// It will be called recursively, once for each clipping face (face=0, 1, ..., 5) to
-// clip against each of the clipping faces in turn.  When face=6, clip_triangle should
-// simply pass the call on to rasterize_triangle.
+// Finish rendering after the last call to render.  With deferred shading,
+// this shades every visible pixel, and with multisampling it resolves the
+// samples of each pixel into image_color.  Otherwise there is nothing left to
+// do.
+void finish_render(driver_state& state);
+
+// Primitive assembly for one triangle produced by the vertex shader.  Triangles
+// entirely outside the view volume, with zero area, or (if cull_back_faces is
+// set) facing away are discarded.  Triangles between the near and far planes
+// and within the guard band go straight to rasterization; only the rest are
+// passed to clip_triangle.
+void assemble_triangle(driver_state& state, const data_geometry& v0,
+    const data_geometry& v1, const data_geometry& v2);
+
+// This function clips a triangle (defined by the three vertices in the "in" array)
+// against the clipping faces face, face+1, ..., 5 and passes the triangles that
+// result on to rasterize_triangle.  With face=6 the triangle is passed on as it
+// is.  The left, right, bottom and top faces are those of the guard band (see
+// GUARD_BAND) rather than of the screen.
 void clip_triangle(driver_state& state, const data_geometry& v0,
     const data_geometry& v1, const data_geometry& v2, int face=0);
 
@@ -19,6 +19,12 @@ for f in os.listdir('.'):
     if re_cp.search(f):
         shutil.copyfile(f, dir+"/"+f)
 
+# Binary vertex and index buffers are named relative to the command file
+re_buffer=re.compile('\.(vb|ib)$')
+for f in os.listdir(test_dir):
+    if re_buffer.search(f):
+        shutil.copyfile(test_dir+'/'+f, dir+"/"+f)
+
 # Discourage cheating
 token='TOKEN'+str(random.randrange(100000,999999))
 
@@ -26,6 +32,7 @@ if subprocess.call('scons',cwd=dir)!=0:
     print("FAIL: Did not compile")
     exit()
 
+# Returns the exit status of the command, or None if it timed out.
 def run_command_with_timeout(cmd, timeout_sec):
     proc = subprocess.Popen(cmd,cwd=dir)
     proc_thread = threading.Thread(target=proc.communicate)
@@ -35,15 +42,15 @@ def run_command_with_timeout(cmd, timeout_sec):
         try:
             proc.kill()
         except OSError as e:
-            return True
-        return False
-    return True
+            return proc.returncode
+        return None
+    return proc.returncode
 
 hashed_tests={}
 total_score=0
 
 ignore_line=re.compile('^\s*(#|$)')
-grade_line=re.compile('^(\S+)\s+(\S+)\s+(\S+)\s+(\S+)\s*$')
+grade_line=re.compile('^(\S+)\s+(\S+)\s+(\S+)\s+(\S+)(?:\s+(\S+))?\s*$')
 gs=0
 try:
     gs=open('grading-scheme.txt')
@@ -65,32 +72,47 @@ for line in gs.readlines():
     max_error=float(g.groups()[1])
     max_time=float(g.groups()[2])
     file=g.groups()[3]
+    solution=g.groups()[4] or file
 
     pass_error = 0
     pass_time = 0
     if not file in hashed_tests:
         timeout = max(int(max_time*1.2*3/1000)+1,2)
         shutil.copyfile(test_dir+'/'+file+".txt", dir+"/file.txt")
-        shutil.copyfile(test_dir+'/'+file+".ppm", dir+"/file.ppm")
-        if not run_command_with_timeout(grade_cmd, timeout):
-            hashed_tests[file]="TIMEOUT"
+        if solution=="error":
+            # The test file is invalid.  The driver must reject it by exiting
+            # with EXIT_FAILURE, rather than crash or render it.
+            status=run_command_with_timeout(grade_cmd[:3], timeout)
+            if status==None:
+                hashed_tests[file]="TIMEOUT"
+            elif status==1:
+                hashed_tests[file]=0.0
+            else:
+                hashed_tests[file]="NOT REJECTED"
         else:
-            try:
-                report=dir+'/'+token+'.txt'
-                results_file=open(report)
-                d=diff_parse.match(results_file.readline())
-                results_file.close()
-                if os.path.isfile(report):
-                    os.remove(report) # remove the diff file
-                if d: d=float(d.groups()[0])
-                hashed_tests[file]=d
-            except:
-                hashed_tests[file]=None
+            shutil.copyfile(test_dir+'/'+solution+".ppm", dir+"/file.ppm")
+            if run_command_with_timeout(grade_cmd, timeout)==None:
+                hashed_tests[file]="TIMEOUT"
+            else:
+                try:
+                    report=dir+'/'+token+'.txt'
+                    results_file=open(report)
+                    d=diff_parse.match(results_file.readline())
+                    results_file.close()
+                    if os.path.isfile(report):
+                        os.remove(report) # remove the diff file
+                    if d: d=float(d.groups()[0])
+                    hashed_tests[file]=d
+                except:
+                    hashed_tests[file]=None
 
     d=hashed_tests[file]
     if d=="TIMEOUT":
         print("FAIL: (%s) Test timed out."%file)
         points=0
+    elif d=="NOT REJECTED":
+        print("FAIL: (%s) Program did not exit with an error."%file)
+        points=0
     elif d==None:
         print("FAIL: (%s) Program failed to report statistics."%file)
         points=0
@@ -3,10 +3,11 @@
  * -------------------------------
  * This is simple testbed for your GLSL implementation.
  *
- * Usage: ./driver -i <input-file> [ -s <solution-file> ] [ -o <stats-file> ]
+ * Usage: ./driver -i <input-file> [ -s <solution-file> ] [ -o <stats-file> ] [ -t <threads> ] [ -c ] [ -d ] [ -m ]
  *     <input-file>      File with commands to run
  *     <solution-file>   File with solution to compare with
  *     <stats-file>      Dump statistics to this file rather than stdout
+ *     <threads>         Number of rasterization threads (default: one per core)
  *
  * Only the -i is manditory.  You must specify a test to run.  For example:
  *
@@ -24,6 +25,23 @@
  *
  * The -o flag is used for the grading script, so that grading will not be
  * confused by debug print statements.
+ *
+ * The -t flag sets the number of threads used for rasterization.  The output
+ * does not depend on it; -t 1 selects the simpler single-threaded path.
+ *
+ * The -c flag enables back-face culling: triangles whose vertices appear
+ * clockwise on the screen are not drawn.  As in OpenGL, the vertices of every
+ * other triangle of a strip are taken in the opposite order.  A command file
+ * may also turn culling on or off with the cull command.
+ *
+ * The -d flag enables deferred shading: rendering only determines which
+ * triangle is visible at each pixel, and the fragment shader is run once per
+ * visible pixel at the end, however many times the pixel was drawn over.
+ *
+ * The -m flag enables 4x multisample antialiasing: coverage and depth are
+ * tested at four points in each pixel, while the fragment shader still runs
+ * once per pixel.  It cannot be combined with -d.  A command file may also
+ * turn it on or off with the multisample command.
  */
 #include <cassert>
 #include <climits>
@@ -34,11 +52,11 @@
 #include <iostream>
 #include <vector>
 #include <chrono>
+#include <thread>
 #include "driver_state.h"
+#include "parse.h"
 #include <sstream>
 
-void parse(const char* test_file, driver_state& state);
-
 char *optarg = NULL;  // Global variable to hold the argument for the current option
 int optind = 1;       // Index of the next argument to process
 
@@ -164,21 +182,20 @@ void Dump_ppm(pixel* data,int width,int height,const char* filename)
     file.close();
 }
 
-// Compare the computed solution (in state) to the solution_file
-void compare(driver_state& state, FILE* stats_file, const char* solution_file)
+// Compare the computed solution (image, as returned by read_image) to the
+// solution_file
+void compare(driver_state& state, const pixel* image, FILE* stats_file, const char* solution_file)
 {
-    // Allocate and initialize space for the solution and difference images
+    // Allocate and initialize space for the difference image.  Read_ppm
+    // allocates the solution image.
     int width_sol = 0;
     int height_sol = 0;
     int size = state.image_width*state.image_height;
     pixel* image_diff = new pixel[size];
-    pixel* image_sol = new pixel[size];
+    pixel* image_sol = 0;
     pixel black = make_pixel(0,0,0);
     for(int i=0;i<size;i++)
-    {
-        image_sol[i]=black;
         image_diff[i]=black;
-    }
 
     // Read the solution file, do some sanity checks.
     Read_ppm(image_sol, width_sol, height_sol, solution_file);
@@ -197,7 +214,7 @@ void compare(driver_state& state, FILE* stats_file, const char* solution_file)
     for(int i=0;i<size;i++)
     {
         int A=image_sol[i];
-        int B=state.image_color[i];
+        int B=image[i];
         int rA,gA,bA,rB,gB,bB;
         from_pixel(A,rA,gA,bA);
         from_pixel(B,rB,gB,bB);
@@ -222,10 +239,14 @@ void compare(driver_state& state, FILE* stats_file, const char* solution_file)
 // Provide assistance in calling this program
 void Usage(const char* prog_name)
 {
-    std::cerr<<"Usage: "<<prog_name<<" -i <input-file> [ -s <solution-file> ] [ -o <stats-file> ]"<<std::endl;
+    std::cerr<<"Usage: "<<prog_name<<" -i <input-file> [ -s <solution-file> ] [ -o <stats-file> ] [ -t <threads> ] [ -c ] [ -d ] [ -m ]"<<std::endl;
     std::cerr<<"    <input-file>      File with commands to run"<<std::endl;
     std::cerr<<"    <solution-file>   File with solution to compare with"<<std::endl;
     std::cerr<<"    <stats-file>      Dump statistics to this file rather than stdout"<<std::endl;
+    std::cerr<<"    <threads>         Number of rasterization threads (default: one per core)"<<std::endl;
+    std::cerr<<"    -c                Cull back-facing triangles"<<std::endl;
+    std::cerr<<"    -d                Deferred shading"<<std::endl;
+    std::cerr<<"    -m                4x multisample antialiasing"<<std::endl;
     exit(EXIT_FAILURE);
 }
 
@@ -236,17 +257,22 @@ int main(int argc, char** argv)
     const char* statistics_file = 0;
     
     driver_state state;
+    state.num_threads = std::max(1u, std::thread::hardware_concurrency());
 
     // Parse commandline options
     while(1)
     {
-        int opt = getopt(argc, argv, "s:i:o:");
+        int opt = getopt(argc, argv, "s:i:o:t:cdm");
         if(opt==-1) break;
         switch(opt)
         {
             case 's': solution_file = optarg; break;
             case 'i': input_file = optarg; break;
             case 'o': statistics_file = optarg; break;
+            case 't': state.num_threads = std::max(1, atoi(optarg)); break;
+            case 'c': state.cull_back_faces = true; break;
+            case 'd': state.deferred = true; break;
+            case 'm': state.msaa = true; break;
         }
     }
 
@@ -256,19 +282,34 @@ int main(int argc, char** argv)
         std::cerr<<"Test file required.  Use -i."<<std::endl;
         Usage(argv[0]);
     }
+    if(state.deferred && state.msaa)
+    {
+        std::cerr<<"Multisampling cannot be combined with deferred shading."<<std::endl;
+        Usage(argv[0]);
+    }
 
     // Parse the input file, setup state, request renders
-    parse(input_file, state);
+    std::string error;
+    if(!parse(input_file, state, error))
+    {
+        printf("%s\n",error.c_str());
+        exit(EXIT_FAILURE);
+    }
+    finish_render(state);
 
     FILE* stats_file = stdout;
     if(statistics_file) stats_file = fopen(statistics_file, "w");
 
+    // The driver stores the image in tiles; put it back in row-major order
+    std::vector<pixel> image(state.image_width*state.image_height);
+    read_image(state, image.data());
+
     // Compare computed solution to solution file, if provided
     if(solution_file)
-        compare(state, stats_file, solution_file);
+        compare(state, image.data(), stats_file, solution_file);
 
     // Save the computed solution to file
-    Dump_ppm(state.image_color,state.image_width,state.image_height,"output.ppm");
+    Dump_ppm(image.data(),state.image_width,state.image_height,"output.ppm");
 
     if(stats_file != stdout) fclose(stats_file);
     return 0;
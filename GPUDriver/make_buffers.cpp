@@ -0,0 +1,142 @@
+/*
+
+  Usage: ./make_buffers <input-file> <output-file>
+
+  Converts a command file so that the vertex data of each render is read from
+  binary buffer files rather than parsed from text.  The v lines of each
+  render are replaced by a vertex_buffer command and its f lines by an
+  index_buffer command, and the data is written to <name>_<n>.vb and
+  <name>_<n>.ib next to the output file, where <name> is the output file's
+  name without its extension and n counts the renders.  All other commands are
+  copied unchanged.  See buffer_file.h for the format.
+
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "buffer_file.h"
+
+// Write a buffer file with count records of width values from data.
+template<class T>
+bool write_buffer(const std::string& filename, const char* magic, int width, int count, const T* data)
+{
+    FILE* F = fopen(filename.c_str(), "wb");
+    if(!F)
+    {
+        std::cerr << "Error: Could not open " << filename << " for writing." << std::endl;
+        return false;
+    }
+    buffer_header header = {};
+    memcpy(header.magic, magic, 4);
+    header.width = width;
+    header.count = count;
+    bool ok = fwrite(&header, sizeof(header), 1, F) == 1;
+    if(count) ok = ok && fwrite(data, sizeof(T) * width, count, F) == (size_t)count;
+    ok = fclose(F) == 0 && ok;
+    if(!ok) std::cerr << "Error: Could not write " << filename << "." << std::endl;
+    return ok;
+}
+
+int main(int argc, char** argv)
+{
+    if(argc!=3)
+    {
+        std::cerr<<"Usage: "<<argv[0]<<" <input-file> <output-file>"<<std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    std::ifstream in(argv[1]);
+    if(!in)
+    {
+        std::cerr<<"Error: Could not open "<<argv[1]<<" for reading."<<std::endl;
+        exit(EXIT_FAILURE);
+    }
+    std::ofstream out(argv[2]);
+    if(!out)
+    {
+        std::cerr<<"Error: Could not open "<<argv[2]<<" for writing."<<std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    // Buffer files go next to the output file, which the driver resolves
+    // their names against.
+    std::string output(argv[2]);
+    size_t slash=output.find_last_of("/\\")+1;
+    std::string directory=output.substr(0,slash);
+    std::string name=output.substr(slash);
+    name=name.substr(0,name.find_last_of('.'));
+
+    // The data of the current render, read as the driver's parser would:
+    // each v line provides floats_per_vertex floats, missing ones being zero.
+    int floats_per_vertex=0;
+    std::vector<float> data;
+    std::vector<int> indices;
+    int renders=0;
+
+    std::string line;
+    while(std::getline(in,line))
+    {
+        std::istringstream ss(line);
+        std::string item;
+        ss>>item;
+        if(item=="vertex_data")
+        {
+            std::string flags;
+            ss>>flags;
+            floats_per_vertex=flags.size();
+        }
+        else if(item=="v")
+        {
+            float x;
+            for(int i=0;i<floats_per_vertex;i++)
+                data.push_back(ss>>x?x:0);
+            continue;
+        }
+        else if(item=="f")
+        {
+            int k;
+            for(int i=0;i<3;i++)
+                indices.push_back(ss>>k?k:0);
+            continue;
+        }
+        else if(item=="render")
+        {
+            // The driver rejects index buffers that refer to missing vertices.
+            std::string type;
+            ss>>type;
+            int count=floats_per_vertex?data.size()/floats_per_vertex:0;
+            for(size_t i=0;type=="indexed" && i<indices.size();i++)
+                if(indices[i]<0 || indices[i]>=count)
+                {
+                    std::cerr<<"Error: Index "<<indices[i]<<" of render "<<renders<<" is out of range for "
+                             <<count<<" vertices."<<std::endl;
+                    exit(EXIT_FAILURE);
+                }
+
+            std::string base=name+"_"+std::to_string(renders++);
+            if(!data.empty())
+            {
+                if(!write_buffer(directory+base+".vb",VERTEX_BUFFER_MAGIC,floats_per_vertex,count,data.data()))
+                    exit(EXIT_FAILURE);
+                out<<"vertex_buffer "<<base<<".vb\n";
+            }
+            if(!indices.empty())
+            {
+                if(!write_buffer(directory+base+".ib",INDEX_BUFFER_MAGIC,3,indices.size()/3,indices.data()))
+                    exit(EXIT_FAILURE);
+                out<<"index_buffer "<<base<<".ib\n";
+            }
+            data.clear();
+            indices.clear();
+        }
+        out<<line<<"\n";
+    }
+
+    std::cout<<"Wrote "<<argv[2]<<" and the buffers of "<<renders<<" renders"<<std::endl;
+    return 0;
+}
@@ -1,61 +1,453 @@
+#include <algorithm>
+#include <cfloat>
+#include <climits>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <functional>
-#include <sstream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
 #include <vector>
+#include "buffer_file.h"
 #include "driver_state.h"
+#include "parse.h"
 #include "shaders.h"
 
-// Parse the input file and issue commands
-void parse(const char* test_file, driver_state& state)
+static bool is_space(char c)
 {
-    // Open file, make sure this succeeded
-    FILE* F = fopen(test_file,"r");
-    if(!F)
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\v' || c == '\f';
+}
+
+// The words of one line of the command file, read in place.
+struct line_reader
+{
+    const char* p;
+    const char* end;
+
+    // The first word that read could not parse as a number, or null.  The
+    // word is still consumed.
+    const char* bad_word;
+    const char* bad_word_end;
+
+    // Find the next word, [word,word_end).  Returns false at the end of the
+    // line.
+    bool next(const char*& word, const char*& word_end)
     {
-        printf("Failed to open file '%s'\n",test_file);
-        exit(EXIT_FAILURE);
+        while(p < end && is_space(*p)) p++;
+        if(p == end) return false;
+        word = p;
+        while(p < end && !is_space(*p)) p++;
+        word_end = p;
+        return true;
     }
 
-    // Initialize the maps that allow us to access shaders by name.
-    register_named_shaders();
+    // Whether the next word is s, consuming it if so.
+    bool next_is(const char* s)
+    {
+        const char *w, *w_end;
+        const char* saved = p;
+        if(next(w, w_end) && (size_t)(w_end - w) == strlen(s) && !memcmp(w, s, w_end - w))
+            return true;
+        p = saved;
+        return false;
+    }
+
+    bool read(float& x);
+    bool read(int& x);
+
+    bool reject(const char* word, const char* word_end)
+    {
+        if(!bad_word)
+        {
+            bad_word = word;
+            bad_word_end = word_end;
+        }
+        return false;
+    }
+};
+
+// Exact powers of ten as doubles.
+static const double powers_of_ten[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+// Parse a number of the form [sign] digits [. digits] [e [sign] digits],
+// which must be the whole word.  When the digits and the power of ten are both
+// small enough to be exact in a double, the value is computed directly as a
+// correctly rounded double.  Rounding that to a float is then also correct,
+// unless the double landed on (or next to) the midpoint between two floats,
+// where the second rounding may go the wrong way.  Those, and anything else,
+// such as a number with many digits, are handed to strtof.
+bool line_reader::read(float& x)
+{
+    const char *w, *w_end;
+    if(!next(w, w_end)) return false;
+
+    const char* s = w;
+    bool negative = false;
+    if(s < w_end && (*s == '-' || *s == '+')) negative = *s++ == '-';
+    uint64_t mantissa = 0;
+    int significant = 0, exponent = 0;
+    bool any_digits = false;
+    for(; s < w_end && *s >= '0' && *s <= '9'; s++)
+    {
+        any_digits = true;
+        if(mantissa || *s != '0') significant++;
+        if(significant <= 19) mantissa = mantissa * 10 + (*s - '0');
+        else exponent++;
+    }
+    if(s < w_end && *s == '.')
+    {
+        for(s++; s < w_end && *s >= '0' && *s <= '9'; s++)
+        {
+            any_digits = true;
+            if(mantissa || *s != '0') significant++;
+            if(significant > 19) continue;
+            mantissa = mantissa * 10 + (*s - '0');
+            exponent--;
+        }
+    }
+    if(!any_digits) return reject(w, w_end);
+    if(s < w_end && (*s == 'e' || *s == 'E'))
+    {
+        const char* e = s + 1;
+        bool negative_exponent = false;
+        if(e < w_end && (*e == '-' || *e == '+')) negative_exponent = *e++ == '-';
+        if(e < w_end && *e >= '0' && *e <= '9')
+        {
+            int value = 0;
+            for(; e < w_end && *e >= '0' && *e <= '9'; e++)
+                if(value < 10000) value = value * 10 + (*e - '0');
+            exponent += negative_exponent ? -value : value;
+            s = e;
+        }
+    }
+    if(s != w_end) return reject(w, w_end);
+
+    if(significant <= 19 && mantissa < (1ull << 53) && exponent >= -22 && exponent <= 22)
+    {
+        double value = (double)mantissa;
+        if(exponent < 0) value /= powers_of_ten[-exponent];
+        else value *= powers_of_ten[exponent];
+        float rounded = (float)value;
+        if(rounded == value)
+        {
+            x = negative ? -rounded : rounded;
+            return true;
+        }
+        float other = std::nextafter(rounded, rounded < value ? HUGE_VALF : 0.0f);
+        double midpoint = ((double)rounded + other) / 2;
+        if(std::fabs(value - midpoint) > value * DBL_EPSILON)
+        {
+            x = negative ? -rounded : rounded;
+            return true;
+        }
+    }
 
-    // scratch space for parsing
-    char buff[1000];
-    ivec3 e;
-
-    // Local copies of the data that will eventually be stored in the driver for
-    // rending.  data => driver.vertex_data, indices => driver.index_data,
-    // uniform => driver.uniform_data.  Note that the driver only stores
-    // pointers into these std::vector's.  This is normally a very bad idea,
-    // since those pointers may change if the std::vectors are modified.  We
-    // must be careful to set the driver pointers only immediately before
-    // issuing the rendering commands.  Since the renders occur within this
-    // function, this data will not be used after these have gone out of scope.
+    // The word is a valid number, so strtof reads all of it.
+    char buff[128];
+    std::string long_word;
+    const char* word = buff;
+    size_t n = w_end - w;
+    if(n < sizeof(buff))
+    {
+        memcpy(buff, w, n);
+        buff[n] = 0;
+    }
+    else
+    {
+        long_word.assign(w, w_end);
+        word = long_word.c_str();
+    }
+    x = strtof(word, 0);
+    return true;
+}
+
+bool line_reader::read(int& x)
+{
+    const char *w, *w_end;
+    if(!next(w, w_end)) return false;
+    const char* s = w;
+    bool negative = false;
+    if(s < w_end && (*s == '-' || *s == '+')) negative = *s++ == '-';
+    if(s == w_end || *s < '0' || *s > '9') return reject(w, w_end);
+    // Values that do not fit in an int are rejected as they grow, which also
+    // keeps value from overflowing.
+    long long value = 0, limit = negative ? -(long long)INT_MIN : INT_MAX;
+    for(; s < w_end && *s >= '0' && *s <= '9'; s++)
+        if((value = value * 10 + (*s - '0')) > limit) return reject(w, w_end);
+    if(s != w_end) return reject(w, w_end);
+    x = negative ? -value : value;
+    return true;
+}
+
+// Call line(reader) for each line of [begin,end), until it returns false.
+static void for_each_line(const char* begin, const char* end,
+    const std::function<bool(line_reader&)>& line)
+{
+    for(const char* p = begin; p < end;)
+    {
+        const char* eol = (const char*)memchr(p, '\n', end - p);
+        if(!eol) eol = end;
+        line_reader reader = {p, eol, 0, 0};
+        if(!line(reader)) return;
+        p = eol + 1;
+    }
+}
+
+// Find the most vertex data floats and triangles that any one render in the
+// file provides, so that the buffers can be allocated once, up front.  This
+// only looks at the commands that determine those sizes.
+static void prescan(const char* begin, const char* end, size_t& max_floats, size_t& max_triangles)
+{
+    size_t floats = 0, triangles = 0;
+    int floats_per_vertex = 0;
+    max_floats = max_triangles = 0;
+    for_each_line(begin, end, [&](line_reader& ss) {
+        const char *w, *w_end;
+        if(ss.next_is("v")) floats += floats_per_vertex;
+        else if(ss.next_is("f")) triangles++;
+        else if(ss.next_is("vertex_data")) floats_per_vertex = ss.next(w, w_end) ? w_end - w : 0;
+        else if(ss.next_is("render"))
+        {
+            max_floats = std::max(max_floats, floats);
+            max_triangles = std::max(max_triangles, triangles);
+            floats = triangles = 0;
+        }
+        return true;
+    });
+    max_floats = std::max(max_floats, floats);
+    max_triangles = std::max(max_triangles, triangles);
+}
+
+// Map the buffer file named by the next word of the line, which is relative
+// to directory, and check its header.  Each file is only mapped once, however
+// many times it is used, and stays mapped in files until rendering is done.
+// Returns the header, which the data follows, or null after setting error.
+static const buffer_header* map_buffer(line_reader& ss, const std::string& directory,
+    const char* magic, std::map<std::string,mapped_file>& files, std::string& error)
+{
+    const char *name="", *name_end=name;
+    ss.next(name, name_end);
+    std::string filename(name, name_end);
+    if(filename[0]!='/') filename=directory+filename;
+
+    bool is_new=!files.count(filename);
+    mapped_file& file=files[filename];
+    if(is_new && !file.open(filename.c_str()))
+    {
+        files.erase(filename);
+        error="Failed to open buffer file '"+filename+"'";
+        return 0;
+    }
+    const buffer_header* header=(const buffer_header*)file.begin();
+    size_t size=file.end()-file.begin();
+    if(size<sizeof(buffer_header) || memcmp(header->magic, magic, 4) || header->width<=0 || header->count<0
+        || (size-sizeof(buffer_header))/4/header->width<(size_t)header->count)
+    {
+        error="Invalid buffer file '"+filename+"'";
+        return 0;
+    }
+    return header;
+}
+
+// The driver state set up by the commands other than size and render, which
+// applies to every render after them.
+struct draw_settings
+{
+    shader_v vertex_shader=0;
+    shader_v_batch vertex_shader_batch=0;
+    shader_f fragment_shader=0;
+    fragment_shader_info fragment_info={~0ull,false};
     int floats_per_vertex=0;
+    interp_type interp_rules[MAX_FLOATS_PER_VERTEX]={};
+    std::vector<float> uniform;
+
+    // Sets cull_back_faces when 0 or 1; -1 leaves it as it is.
+    int cull=-1;
+};
+
+// A command for the render thread: a size command, a render with everything
+// it needs, or a parse error, which ends the commands.  A size command also
+// sets msaa when multisample is 0 or 1.  vertex_data and index_data point
+// either into data and indices or into a mapped buffer file.
+struct draw_command
+{
+    enum command_type {size, render, error} type;
+    int width, height;
+    int multisample;
+    std::string message;
+
+    render_type primitive;
+    draw_settings settings;
     std::vector<float> data;
     std::vector<ivec3> indices;
-    std::vector<float> uniform;
+    const float* vertex_data;
+    int num_vertices;
+    const int* index_data;
+    int num_triangles;
+};
 
-    // Parse the input, line by line
-    while(fgets(buff, sizeof(buff), F))
+// A bounded queue of commands from the parser thread to the render thread.
+// Commands are filled in place in a fixed ring of slots, so that their
+// buffers are reused rather than reallocated.  The parser waits when the
+// render thread falls capacity commands behind.
+class draw_queue
+{
+public:
+    explicit draw_queue(int capacity) :slots(capacity) {}
+
+    // Parser: wait for a free slot and return it, to be filled and then
+    // passed on with push.
+    draw_command& acquire()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [this]{return tail-head<slots.size();});
+        return slots[tail%slots.size()];
+    }
+
+    // Parser: pass on the slot returned by acquire, or with done set, signal
+    // that there are no more commands.
+    void push(bool done=false)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if(done) finished=true;
+            else tail++;
+        }
+        changed.notify_all();
+    }
+
+    // Renderer: wait for the next command, returning null once there are no
+    // more.  It stays valid until pop.
+    draw_command* front()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [this]{return head<tail || finished;});
+        return head<tail?&slots[head%slots.size()]:0;
+    }
+
+    void pop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            head++;
+        }
+        changed.notify_all();
+    }
+
+private:
+    std::vector<draw_command> slots;
+    size_t head=0, tail=0;
+    bool finished=false;
+    std::mutex mutex;
+    std::condition_variable changed;
+};
+
+// Carry out a command on the render thread, setting error if it cannot be.
+static void run_command(driver_state& state, draw_command& c, std::string& error)
+{
+    if(c.type==draw_command::size)
     {
-        std::stringstream ss(buff);
-        std::string item,name;
+        if(c.multisample>=0) state.msaa=c.multisample;
+        if(state.msaa && state.deferred)
+        {
+            error="Multisampling cannot be combined with deferred shading.";
+            return;
+        }
+        initialize_render(state, c.width, c.height);
+        return;
+    }
+
+    // Assign pointers in driver immediately before doing the render to
+    // avoid memory errors.  The driver only reads vertex_data and
+    // index_data, so they may point into read-only mapped buffers.
+    draw_settings& s=c.settings;
+    state.vertex_shader=s.vertex_shader;
+    state.vertex_shader_batch=s.vertex_shader_batch;
+    state.fragment_shader=s.fragment_shader;
+    state.fragment_info=s.fragment_info;
+    if(s.cull>=0) state.cull_back_faces=s.cull;
+    std::copy(s.interp_rules, s.interp_rules+MAX_FLOATS_PER_VERTEX, state.interp_rules);
+    state.vertex_data=(float*)c.vertex_data;
+    state.num_vertices=c.num_vertices;
+    state.floats_per_vertex=s.floats_per_vertex;
+    state.index_data=(int*)c.index_data;
+    state.num_triangles=c.num_triangles;
+    state.uniform_data=s.uniform.size()?&s.uniform[0]:0;
+    state.num_uniforms=s.uniform.size();
+    render(state,c.primitive);
+}
+
+// Parse the commands in [begin,end) and pass them to queue, on the parser
+// thread.  Buffer files are mapped into files, which must outlive the renders
+// that use them.
+static void parse_commands(const char* begin, const char* end, const std::string& directory,
+    std::map<std::string,mapped_file>& files, draw_queue& queue)
+{
+    // The data of the current render.  These are sized for the largest
+    // render up front, holding num_floats and num_triangles entries, and are
+    // swapped with the buffers of the queue slot that the render goes into.
+    draw_settings settings;
+    size_t max_floats, max_triangles;
+    prescan(begin, end, max_floats, max_triangles);
+    std::vector<float> data(max_floats);
+    std::vector<ivec3> indices(max_triangles);
+    size_t num_floats=0, num_triangles=0;
+
+    // Set by multisample for the next size command; -1 leaves msaa as it is.
+    int multisample=-1;
 
-        // If we did not get a line, the line is empty, or the line is a
-        // comment, then move on.
-        if(!(ss>>item) || !item.size() || item[0]=='#') continue;
-        if(item=="size")
+    // Vertex and index buffers given for the current render, which replace
+    // the v and f lines.  See buffer_file.h.
+    const buffer_header* vertex_buffer=0;
+    const buffer_header* index_buffer=0;
+    std::string error;
+
+    // Parse the input, line by line
+    for_each_line(begin, end, [&](line_reader& ss) {
+        const char *item, *item_end;
+
+        // If the line is empty or a comment, then move on.
+        line_reader line=ss;
+        if(!ss.next(item, item_end) || item[0]=='#') return true;
+        ss=line;
+        if(ss.next_is("size"))
         {
             // format: size <w> <h>
             // Set image size.
-            int w,h;
-            ss>>w>>h;
-            initialize_render(state, w, h);
+            draw_command& c=queue.acquire();
+            c.type=draw_command::size;
+            c.width=c.height=0;
+            ss.read(c.width) && ss.read(c.height);
+            c.multisample=multisample;
+            if(!ss.bad_word) queue.push();
+        }
+        else if(ss.next_is("cull"))
+        {
+            // format: cull <on|off>
+            // Turn culling of back-facing triangles on or off for the
+            // renders that follow, overriding -c.
+            if(ss.next_is("on")) settings.cull=1;
+            else if(ss.next_is("off")) settings.cull=0;
+            else error="Expected on or off after cull";
         }
-        else if(item=="vertex_data")
+        else if(ss.next_is("multisample"))
+        {
+            // format: multisample <on|off>
+            // Turn multisample antialiasing (see msaa in driver_state.h) on
+            // or off, overriding -m.  It takes effect at the next size
+            // command, which starts a new frame.
+            if(ss.next_is("on")) multisample=1;
+            else if(ss.next_is("off")) multisample=0;
+            else error="Expected on or off after multisample";
+        }
+        else if(ss.next_is("vertex_data"))
         {
             // format: vertex_data <flags>
             // The flags consists of a string of the characters f, n, or s.
@@ -67,37 +459,44 @@ void parse(const char* test_file, driver_state& state)
             // n: non-perspective-correct interpolation
             // s: smooth; perspective-correct interpolation
             // The length of the string is used to deduce floats_per_vertex.
-            ss>>buff;
-            int i;
-            for(i=0;buff[i];i++)
+            const char *flags, *flags_end;
+            int i=0;
+            if(ss.next(flags, flags_end))
             {
-                if(buff[i]=='s') state.interp_rules[i]=interp_type::smooth;
-                else if(buff[i]=='n') state.interp_rules[i]=interp_type::noperspective;
-                else if(buff[i]=='f') state.interp_rules[i]=interp_type::flat;
-                else assert("invalid interpolation type" && 0);
+                if(flags_end-flags>MAX_FLOATS_PER_VERTEX)
+                    error="Too many floats per vertex: "+std::to_string(flags_end-flags)
+                        +" (at most "+std::to_string(MAX_FLOATS_PER_VERTEX)+")";
+                for(;error.empty() && flags+i<flags_end;i++)
+                {
+                    if(flags[i]=='s') settings.interp_rules[i]=interp_type::smooth;
+                    else if(flags[i]=='n') settings.interp_rules[i]=interp_type::noperspective;
+                    else if(flags[i]=='f') settings.interp_rules[i]=interp_type::flat;
+                    else error="Invalid interpolation type: '"+std::string(1,flags[i])+"'";
+                }
             }
-            floats_per_vertex=i;
+            settings.floats_per_vertex=i;
         }
-        else if(item=="v")
+        else if(ss.next_is("v"))
         {
             // format: v <float> <float> <float> ...
             // Provides the per-vertex data for one vertex
-            // There should be floats_per_vertex floats on the line.
-            float x;
-            for(int i=0;i<floats_per_vertex;i++)
-            {
-                if(ss>>x) data.push_back(x);
-                else data.push_back(0);
-            }
+            // There should be floats_per_vertex floats on the line; missing
+            // ones are zero.
+            float* out=&data[num_floats];
+            num_floats+=settings.floats_per_vertex;
+            bool ok=true;
+            for(int i=0;i<settings.floats_per_vertex;i++)
+                if(!(ok=ok && ss.read(out[i]))) out[i]=0;
         }
-        else if(item=="f")
+        else if(ss.next_is("f"))
         {
             // format: f <index> <index> <index>
             // Provides the indices of the vertices for one triangle.
-            ss>>e;
-            indices.push_back(e);
+            ivec3& e=indices[num_triangles++];
+            for(int i=0;i<3;i++)
+                if(!ss.read(e[i])) e[i]=0;
         }
-        else if(item=="render")
+        else if(ss.next_is("render"))
         {
             // format: render <type>
             // Render the information that has been accumulated, and then clear
@@ -108,57 +507,190 @@ void parse(const char* test_file, driver_state& state)
             //            to a triangle.  These numbers are indices into vertex_data.
             // fan -      The vertices are to be interpreted as a triangle fan.
             // strip -    The vertices are to be interpreted as a triangle strip.
-            // Assign pointers in driver immediately before doing the render to
-            // avoid memory errors.
-            ss>>name;
-            state.vertex_data=&data[0];
-            state.num_vertices=data.size()/floats_per_vertex;
-            state.floats_per_vertex=floats_per_vertex;
-            state.index_data=indices.size()?&indices[0][0]:0;
-            state.num_triangles=indices.size();
-            state.uniform_data=uniform.size()?&uniform[0]:0;
-            render_type t;
-            if(name=="indexed") t=render_type::indexed;
-            else if(name=="fan") t=render_type::fan;
-            else if(name=="triangle") t=render_type::triangle;
-            else if(name=="strip") t=render_type::strip;
-            else assert("invalid render type" && 0);
-            render(state,t);
-            data.clear();
-            indices.clear();
-        }
-        else if(item=="uniform")
+            draw_command& c=queue.acquire();
+            c.type=draw_command::render;
+            if(ss.next_is("indexed")) c.primitive=render_type::indexed;
+            else if(ss.next_is("fan")) c.primitive=render_type::fan;
+            else if(ss.next_is("triangle")) c.primitive=render_type::triangle;
+            else if(ss.next_is("strip")) c.primitive=render_type::strip;
+            else
+            {
+                const char *type, *type_end;
+                if(!ss.next(type, type_end)) type=type_end="";
+                error="Invalid render type: '"+std::string(type,type_end)+"'";
+            }
+            c.settings=settings;
+            std::swap(c.data, data);
+            std::swap(c.indices, indices);
+            c.vertex_data=c.data.data();
+            c.num_vertices=settings.floats_per_vertex?num_floats/settings.floats_per_vertex:0;
+            if(vertex_buffer)
+            {
+                c.vertex_data=(const float*)(vertex_buffer+1);
+                c.num_vertices=vertex_buffer->count;
+            }
+            c.index_data=num_triangles?&c.indices[0][0]:0;
+            c.num_triangles=num_triangles;
+            if(index_buffer)
+            {
+                c.index_data=(const int*)(index_buffer+1);
+                c.num_triangles=index_buffer->count;
+            }
+
+            // The driver trusts the vertices and indices, which may come
+            // straight from buffer files, so check them against the settings
+            // of this render.  A buffer may be bound before the vertex_data
+            // command that it has to match.
+            if(error.empty())
+            {
+                if(!settings.floats_per_vertex)
+                    error="No vertex_data before render";
+                else if(vertex_buffer && vertex_buffer->width!=settings.floats_per_vertex)
+                    error="Vertex buffer has "+std::to_string(vertex_buffer->width)+" floats per vertex, not "
+                        +std::to_string(settings.floats_per_vertex);
+                else if(c.primitive==render_type::indexed)
+                    for(int i=0;i<3*c.num_triangles;i++)
+                        if(c.index_data[i]<0 || c.index_data[i]>=c.num_vertices)
+                        {
+                            error="Index "+std::to_string(c.index_data[i])+" is out of range for "
+                                +std::to_string(c.num_vertices)+" vertices";
+                            break;
+                        }
+            }
+            if(!error.empty())
+            {
+                c.type=draw_command::error;
+                c.message=error;
+                queue.push();
+                return false;
+            }
+            queue.push();
+
+            data.resize(max_floats);
+            indices.resize(max_triangles);
+            num_floats=0;
+            num_triangles=0;
+            vertex_buffer=0;
+            index_buffer=0;
+        }
+        else if(ss.next_is("vertex_buffer"))
+        {
+            // format: vertex_buffer <file>
+            // Use the vertices stored in a binary vertex buffer file for the
+            // next render, instead of v lines.  It must have floats_per_vertex
+            // floats per vertex when the render command is reached.
+            vertex_buffer=map_buffer(ss, directory, VERTEX_BUFFER_MAGIC, files, error);
+        }
+        else if(ss.next_is("index_buffer"))
+        {
+            // format: index_buffer <file>
+            // Use the triangles stored in a binary index buffer file for the
+            // next render, instead of f lines.
+            index_buffer=map_buffer(ss, directory, INDEX_BUFFER_MAGIC, files, error);
+            if(index_buffer && index_buffer->width!=3)
+                error="Index buffer has "+std::to_string(index_buffer->width)+" indices per triangle, not 3";
+        }
+        else if(ss.next_is("uniform"))
         {
             // format: uniform <float> <float> <float> ...
             // Provide all of the uniform data for the render.
-            uniform.clear();
+            settings.uniform.clear();
             float x;
-            while(ss>>x) uniform.push_back(x);
+            while(ss.read(x)) settings.uniform.push_back(x);
         }
-        else if(item=="vertex_shader")
+        else if(ss.next_is("vertex_shader"))
         {
             // format: vertex_shader <name>
             // Set the vertex shader
-            ss>>name;
-            state.vertex_shader=vertex_shader_map[name];
-            assert(state.vertex_shader);
+            const char *name="", *name_end=name;
+            ss.next(name, name_end);
+            std::string key(name, name_end);
+            auto shader=vertex_shader_map.find(key);
+            if(shader==vertex_shader_map.end()) error="Unknown vertex shader: '"+key+"'";
+            else settings.vertex_shader=shader->second;
+
+            // Use the batched version of the shader, if there is one
+            auto batch=vertex_shader_batch_map.find(key);
+            settings.vertex_shader_batch=batch!=vertex_shader_batch_map.end()?batch->second:0;
         }
-        else if(item=="fragment_shader")
+        else if(ss.next_is("fragment_shader"))
         {
             // format: fragment_shader <name>
             // Set the fragment shader
-            ss>>name;
-            state.fragment_shader=fragment_shader_map[name];
-            assert(state.fragment_shader);
+            const char *name="", *name_end=name;
+            ss.next(name, name_end);
+            std::string key(name, name_end);
+            auto shader=fragment_shader_map.find(key);
+            if(shader==fragment_shader_map.end()) error="Unknown fragment shader: '"+key+"'";
+            else settings.fragment_shader=shader->second;
+
+            // The driver assumes nothing about shaders without information.
+            auto info=fragment_shader_info_map.find(key);
+            settings.fragment_info=info!=fragment_shader_info_map.end()?info->second:fragment_shader_info{~0ull,false};
         }
         else
         {
             // Check for parse errors.
-            int len=strlen(buff);
-            if(buff[len-1]=='\n') buff[len-1]=0;
-            printf("Unrecognized command: '%s'\n",buff);
-            exit(EXIT_FAILURE);
+            const char* end=line.end;
+            if(end>line.p && end[-1]=='\r') end--;
+            error="Unrecognized command: '"+std::string(line.p,end)+"'";
         }
+
+        // Errors are reported by the render thread, after the renders before
+        // them.
+        if(error.empty() && ss.bad_word)
+            error="Invalid number: '"+std::string(ss.bad_word,ss.bad_word_end)+"'";
+        if(error.empty()) return true;
+        draw_command& c=queue.acquire();
+        c.type=draw_command::error;
+        c.message=error;
+        queue.push();
+        return false;
+    });
+    queue.push(true);
+}
+
+// Parse the commands in [begin,end) on a separate thread, which passes them to
+// this one through a bounded queue, so that parsing overlaps with rendering.
+// Renders are still carried out in the order of the commands, on this thread.
+bool parse(const char* begin, const char* end, const std::string& directory,
+    driver_state& state, std::string& error)
+{
+    // Initialize the maps that allow us to access shaders by name.
+    register_named_shaders();
+
+    // Buffer files stay mapped until after every render.
+    std::map<std::string,mapped_file> buffer_files;
+    draw_queue queue(4);
+    std::thread parser(parse_commands, begin, end, std::cref(directory),
+        std::ref(buffer_files), std::ref(queue));
+    error.clear();
+    for(draw_command* c; (c=queue.front()); queue.pop())
+    {
+        // After an error the remaining commands are only taken off the
+        // queue, so that the parser can finish.
+        if(!error.empty()) continue;
+        if(c->type==draw_command::error) error=c->message;
+        else run_command(state, *c, error);
     }
-    fclose(F);
+    parser.join();
+    return error.empty();
+}
+
+// Parse the input file and issue commands.
+bool parse(const char* test_file, driver_state& state, std::string& error)
+{
+    // Open file, make sure this succeeded
+    mapped_file F;
+    if(!F.open(test_file))
+    {
+        error=std::string("Failed to open file '")+test_file+"'";
+        return false;
+    }
+
+    // Buffer files are named relative to the directory of the command file
+    std::string directory(test_file);
+    directory.erase(directory.find_last_of("/\\")+1);
+
+    return parse(F.begin(), F.end(), directory, state, error);
 }
@@ -0,0 +1,26 @@
+#ifndef __PARSE__
+#define __PARSE__
+
+#include <string>
+#include "driver_state.h"
+
+// The driver can be used as a library (libgpudriver), without main.cpp.  Each
+// driver_state is an independent context: set its options (num_threads,
+// cull_back_faces, deferred, msaa), then either issue commands from a command
+// file with parse or call initialize_render and render directly, and finally
+// call finish_render and read_image.  Different driver_states may be used
+// concurrently from different threads; the only state they share is the
+// table of named shaders, which is read-only once registered.
+
+// Parse the command file test_file and carry out its commands on state.  The
+// file is parsed on a separate thread, overlapping with rendering.  Returns
+// false, with a message in error, if the file cannot be read or contains an
+// error; the renders before the error have still been done.
+bool parse(const char* test_file, driver_state& state, std::string& error);
+
+// Like parse, but for commands held in memory in [begin,end).  Buffer files
+// are named relative to directory, which is empty or ends with a separator.
+bool parse(const char* begin, const char* end, const std::string& directory,
+    driver_state& state, std::string& error);
+
+#endif
@@ -1,8 +1,11 @@
+#include <mutex>
 #include "shaders.h"
 
 // Lookup maps to access a shader by name.
 std::map<std::string,shader_v> vertex_shader_map;
+std::map<std::string,shader_v_batch> vertex_shader_batch_map;
 std::map<std::string,shader_f> fragment_shader_map;
+std::map<std::string,fragment_shader_info> fragment_shader_info_map;
 
 // Simplest useful vertex shader; just copies over the positions.
 void vertex_shader_trivial(const data_vertex& in, data_geometry& out,
@@ -52,6 +55,49 @@ void vertex_shader_transform(const data_vertex& in, data_geometry& out,
     out.gl_Position = xform * vec4(v.position,1);
 }
 
+// Batched versions of the vertex shaders above.  Each computes exactly what the
+// scalar shader does for every vertex of the batch, with the same operations
+// in the same order; the loops over the batch are vectorized by the compiler.
+
+// Transform the positions position_x, position_y and position_z of a batch
+// by xform, as xform * vec4(position,1) does.
+static void transform_batch(const mat4& xform, const float* position_x,
+    const float* position_y, const float* position_z, data_geometry_batch& out)
+{
+    for(int r=0;r<4;r++)
+    {
+        float* p = out.gl_Position[r];
+        for(int i=0;i<VERTEX_BATCH_SIZE;i++)
+        {
+            float v = 0;
+            v += xform(r,0)*position_x[i];
+            v += xform(r,1)*position_y[i];
+            v += xform(r,2)*position_z[i];
+            v += xform(r,3)*1.0f;
+            p[i] = v;
+        }
+    }
+}
+
+// Batched vertex_shader_color
+void vertex_shader_color_batch(const data_vertex_batch& in, data_geometry_batch& out,
+    const float * uniform_data)
+{
+    const mat4& xform = *(const mat4*)uniform_data;
+    transform_batch(xform, in.data[0], in.data[1], in.data[2], out);
+    for(int k=3;k<6;k++)
+        for(int i=0;i<VERTEX_BATCH_SIZE;i++)
+            out.data[k][i] = in.data[k][i];
+}
+
+// Batched vertex_shader_transform
+void vertex_shader_transform_batch(const data_vertex_batch& in, data_geometry_batch& out,
+    const float * uniform_data)
+{
+    const mat4& xform = *(const mat4*)uniform_data;
+    transform_batch(xform, in.data[0], in.data[1], in.data[2], out);
+}
+
 // Simple fragment shader: set the fragment to red
 void fragment_shader_red(const data_fragment& in, data_output& out,
     const float * uniform_data)
@@ -104,19 +150,35 @@ void fragment_shader_gouraud2(const data_fragment& in, data_output& out,
     out.output_color = vec4(v.color,0);
 }
 
-// Assign shaders to the maps so they can be accessed by name.
+// Assign shaders to the maps so they can be accessed by name.  This is only
+// done once, however many times it is called, and from however many threads;
+// after that the maps are only read.
 void register_named_shaders()
 {
-    vertex_shader_map["trivial"]=vertex_shader_trivial;
-    vertex_shader_map["reorder"]=vertex_shader_reorder;
-    vertex_shader_map["transform"]=vertex_shader_transform;
-    vertex_shader_map["color"]=vertex_shader_color;
-    vertex_shader_map["color2"]=vertex_shader_color2;
-    fragment_shader_map["red"]=fragment_shader_red;
-    fragment_shader_map["green"]=fragment_shader_green;
-    fragment_shader_map["blue"]=fragment_shader_blue;
-    fragment_shader_map["white"]=fragment_shader_white;
-    fragment_shader_map["gouraud"]=fragment_shader_gouraud;
-    fragment_shader_map["gouraud2"]=fragment_shader_gouraud2;
-    fragment_shader_map["uniform"]=fragment_shader_uniform;
+    static std::once_flag registered;
+    std::call_once(registered, []{
+        vertex_shader_map["trivial"]=vertex_shader_trivial;
+        vertex_shader_map["reorder"]=vertex_shader_reorder;
+        vertex_shader_map["transform"]=vertex_shader_transform;
+        vertex_shader_map["color"]=vertex_shader_color;
+        vertex_shader_map["color2"]=vertex_shader_color2;
+        vertex_shader_batch_map["transform"]=vertex_shader_transform_batch;
+        vertex_shader_batch_map["color"]=vertex_shader_color_batch;
+        fragment_shader_map["red"]=fragment_shader_red;
+        fragment_shader_map["green"]=fragment_shader_green;
+        fragment_shader_map["blue"]=fragment_shader_blue;
+        fragment_shader_map["white"]=fragment_shader_white;
+        fragment_shader_map["gouraud"]=fragment_shader_gouraud;
+        fragment_shader_map["gouraud2"]=fragment_shader_gouraud2;
+        fragment_shader_map["uniform"]=fragment_shader_uniform;
+
+        // The gouraud shaders read only the three floats of the color.
+        fragment_shader_info_map["red"]={0,true};
+        fragment_shader_info_map["green"]={0,true};
+        fragment_shader_info_map["blue"]={0,true};
+        fragment_shader_info_map["white"]={0,true};
+        fragment_shader_info_map["uniform"]={0,true};
+        fragment_shader_info_map["gouraud"]={0x7ull<<3,false};
+        fragment_shader_info_map["gouraud2"]={0x7,false};
+    });
 }
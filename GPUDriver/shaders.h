@@ -46,8 +46,13 @@ struct transform_color : public uniform_transform
     vec3 color;
 };
 
+// Lookup maps to access a shader by name, filled by register_named_shaders.
+// They are shared by every driver_state, so after registration they are only
+// read, with find, which is safe from any number of threads.
 extern std::map<std::string,shader_v> vertex_shader_map;
+extern std::map<std::string,shader_v_batch> vertex_shader_batch_map;
 extern std::map<std::string,shader_f> fragment_shader_map;
+extern std::map<std::string,fragment_shader_info> fragment_shader_info_map;
 void register_named_shaders();
 
 #endif
@@ -0,0 +1,68 @@
+#include "thread_pool.h"
+
+thread_pool::thread_pool(int num_threads)
+    :next_task(0)
+{
+    for(int i=1;i<num_threads;i++)
+        workers.push_back(std::thread(&thread_pool::worker_loop, this));
+}
+
+thread_pool::~thread_pool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping=true;
+    }
+    start_cv.notify_all();
+    for(size_t i=0;i<workers.size();i++)
+        workers[i].join();
+}
+
+void thread_pool::run(int n, const std::function<void(int)>& task_in)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        task=&task_in;
+        num_tasks=n;
+        next_task=0;
+        workers_done=0;
+        generation++;
+    }
+    start_cv.notify_all();
+
+    work();
+
+    // The task must stay alive until every worker has stopped looking at it.
+    std::unique_lock<std::mutex> lock(mutex);
+    done_cv.wait(lock, [this]{return workers_done==(int)workers.size();});
+    task=0;
+}
+
+void thread_pool::worker_loop()
+{
+    int seen=0;
+    while(true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            start_cv.wait(lock, [&]{return stopping || generation!=seen;});
+            if(stopping) return;
+            seen=generation;
+        }
+
+        work();
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            workers_done++;
+        }
+        done_cv.notify_one();
+    }
+}
+
+// Claim and run tasks until there are none left.
+void thread_pool::work()
+{
+    for(int i=next_task++;i<num_tasks;i=next_task++)
+        (*task)(i);
+}
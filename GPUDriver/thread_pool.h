@@ -0,0 +1,45 @@
+#ifndef __THREAD_POOL__
+#define __THREAD_POOL__
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of worker threads that can be handed a batch of independent
+// tasks.  The threads are created once and reused for every batch, so that
+// per-render overhead is only a wake-up rather than thread creation.
+class thread_pool
+{
+public:
+    // Create a pool that runs tasks on num_threads threads in total.  The
+    // thread calling run counts as one of them.
+    explicit thread_pool(int num_threads);
+    ~thread_pool();
+
+    // Call task(i) for i = 0, 1, ..., n-1, spread over the threads of the
+    // pool, and return once all of the calls have finished.  Tasks are
+    // handed out in increasing order of i.
+    void run(int n, const std::function<void(int)>& task);
+
+    int size() const {return workers.size()+1;}
+
+private:
+    void worker_loop();
+    void work();
+
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable start_cv, done_cv;
+
+    const std::function<void(int)>* task = 0;
+    int num_tasks = 0;
+    std::atomic<int> next_task;
+    int generation = 0;
+    int workers_done = 0;
+    bool stopping = false;
+};
+
+#endif